@@ -0,0 +1,985 @@
+/*
+ * deflate.c: zlib encoder for usspack that optimises for ussload
+ * decompression speed on the 68000, and a decode time estimator.
+ *
+ * Output is a standard zlib stream, any inflate can read it. The parse is
+ * chosen by estimated cost: compressed bits * cycles per bit (the load
+ * time trade-off) + estimated inflate.S decode cycles, see CYC_ below.
+ * This favours long matches that use the wide copy, drops short matches
+ * that decode slower than literals and avoids literal codes that need a
+ * tree walk or don't fit the pair table. Blocks are large (BLOCKSIZE) and
+ * compressed in parallel, one block per job.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "usspack.h"
+
+// 68000 inflate.S estimates (OPT_MULTI_SYMBOL, OPT_WIDE_COPY,
+// OPT_PREGENERATE_TABLES, 8-bit lookup tables). Fitted to simulated
+// decode times of zlib and deflate_fast streams, within ~6%.
+#define TABLE_BITS 8
+#define CYC_BIT 7		// per stream bit: shifts and refills
+#define CYC_LITERAL 117		// decode_single
+#define CYC_PAIR 136		// decode_pairs, two literals with one lookup
+#define CYC_TREE_BIT 58		// per code bit that doesn't fit the table
+#define CYC_MATCH 430		// length and distance symbols, extra bits
+#define CYC_BYTE_COPY 20	// per byte, byte_copy
+#define CYC_WIDE_COPY 6		// per byte, wide_copy and run_fill
+#define CYC_WIDE_SETUP 130
+#define CYC_STORED 8		// per byte, stored block
+#define CYC_BLOCK 1000		// block header
+#define CYC_DYNAMIC 185000	// dynamic_huffman + build_code + build_pairs
+#define CYC_STATIC_BUILD 220000	// first static block, later ones use the cache
+#define CYC_STATIC_CACHED 2000
+
+#define WSIZE 32768
+#define MINMATCH 3
+#define MAXMATCH 258
+#define BLOCKSIZE (128 * 1024)
+#define STORED_MAX 65535
+#define HASHBITS 16
+#define MAXCHAIN 1024
+#define MAXCAND 8
+#define NICEMATCH 128		// take longer matches without trying shorter ones
+#define PASSES 3
+#define MAXBITS 15
+#define MAXBITS_CODELEN 7
+
+#define NLITLEN 286
+#define NDIST 30
+#define EOB 256
+
+#define BLOCK_STORED 0
+#define BLOCK_STATIC 1
+#define BLOCK_DYNAMIC 2
+
+static const UWORD length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const UBYTE length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const UWORD dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const UBYTE dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+static const UBYTE codelen_order[19] = {
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+static int length_symbol(ULONG len)
+{
+	int s = 0;
+	while (s < 28 && len >= length_base[s + 1])
+		s++;
+	return s;
+}
+
+static int dist_symbol(ULONG dist)
+{
+	if (dist <= 4)
+		return dist - 1;
+	int b = 31 - __builtin_clz(dist - 1);
+	return 2 * b + (((dist - 1) >> (b - 1)) & 1);
+}
+
+// copy loop cycles of one match
+static ULONG copy_cycles(ULONG len, ULONG dist)
+{
+	// on the 68000 source and destination must be equally aligned
+	if (len >= 16 && (dist == 1 || (dist >= 4 && !(dist & 1))))
+		return CYC_WIDE_SETUP + len * CYC_WIDE_COPY;
+	return len * CYC_BYTE_COPY;
+}
+
+static ULONG tree_cycles(int bits)
+{
+	return bits > TABLE_BITS ? (bits - TABLE_BITS) * CYC_TREE_BIT : 0;
+}
+
+// inflate.S builds the pair table when at least 1/8 of the lookup table
+// entries decode two literals
+static int pair_mode(const UBYTE *litlen)
+{
+	double f = 0;
+	for (int a = 0; a < 256; a++) {
+		if (!litlen[a] || litlen[a] >= TABLE_BITS)
+			continue;
+		for (int b = 0; b < 256; b++) {
+			if (litlen[b] && litlen[a] + litlen[b] <= TABLE_BITS)
+				f += 1.0 / (1 << (litlen[a] + litlen[b]));
+		}
+	}
+	return f >= 1.0 / 8;
+}
+
+// decode cycle counter, follows the pair decoder: a literal pairs with
+// the next one if both codes fit in the lookup table index
+struct cyclecount
+{
+	uint64_t cycles;
+	int pairmode;
+	int pending;
+	ULONG pairs;
+};
+
+static void cc_flush(struct cyclecount *cc)
+{
+	if (cc->pending)
+		cc->cycles += CYC_LITERAL;
+	cc->pending = 0;
+}
+
+static void cc_literal(struct cyclecount *cc, int bits)
+{
+	if (cc->pending && cc->pending + bits <= TABLE_BITS) {
+		cc->cycles += CYC_PAIR;
+		cc->pairs++;
+		cc->pending = 0;
+		return;
+	}
+	cc_flush(cc);
+	if (cc->pairmode && bits < TABLE_BITS)
+		cc->pending = bits;
+	else
+		cc->cycles += CYC_LITERAL + tree_cycles(bits);
+}
+
+static void cc_match(struct cyclecount *cc, int lbits, int dbits, ULONG len, ULONG dist)
+{
+	cc_flush(cc);
+	cc->cycles += CYC_MATCH + tree_cycles(lbits) + tree_cycles(dbits) + copy_cycles(len, dist);
+}
+
+/* Huffman code construction */
+
+// length limited Huffman code lengths, at least two symbols must be used
+static void huffman_lengths(const ULONG *freq, int n, int limit, UBYTE *lens)
+{
+	int syms[NLITLEN + 2], parent[2 * (NLITLEN + 2)], depth[2 * (NLITLEN + 2)];
+	ULONG w[2 * (NLITLEN + 2)];
+	int count[32] = { 0 };
+	int m = 0;
+
+	memset(lens, 0, n);
+	for (int i = 0; i < n; i++) {
+		if (freq[i])
+			syms[m++] = i;
+	}
+	// sort by frequency, stable
+	for (int i = 1; i < m; i++) {
+		int v = syms[i], k = i;
+		for (; k > 0 && freq[syms[k - 1]] > freq[v]; k--)
+			syms[k] = syms[k - 1];
+		syms[k] = v;
+	}
+
+	// two queue construction: leaves sorted, internal nodes come in order
+	int li = 0, ni = m, nn = m;
+	for (int i = 0; i < m; i++)
+		w[i] = freq[syms[i]];
+	for (int k = 0; k < m - 1; k++) {
+		int ab[2];
+		for (int j = 0; j < 2; j++) {
+			if (li < m && (ni >= nn || w[li] <= w[ni]))
+				ab[j] = li++;
+			else
+				ab[j] = ni++;
+		}
+		w[nn] = w[ab[0]] + w[ab[1]];
+		parent[ab[0]] = parent[ab[1]] = nn;
+		nn++;
+	}
+	depth[nn - 1] = 0;
+	for (int i = nn - 2; i >= 0; i--)
+		depth[i] = depth[parent[i]] + 1;
+	int maxlen = 0;
+	for (int i = 0; i < m; i++) {
+		count[depth[i]]++;
+		if (depth[i] > maxlen)
+			maxlen = depth[i];
+	}
+	// move overlong codes up, keeping the code complete
+	for (int i = maxlen; i > limit; i--) {
+		while (count[i] > 0) {
+			int j = i - 2;
+			while (!count[j])
+				j--;
+			count[i] -= 2;
+			count[i - 1]++;
+			count[j + 1] += 2;
+			count[j]--;
+		}
+	}
+	// most frequent symbols get the shortest codes
+	int s = m - 1;
+	for (int len = 1; len <= limit; len++) {
+		for (int i = 0; i < count[len]; i++)
+			lens[syms[s--]] = len;
+	}
+}
+
+// canonical codes, bit reversed for the LSB first bit stream
+static void huffman_codes(const UBYTE *lens, int n, UWORD *codes)
+{
+	UWORD count[MAXBITS + 1] = { 0 }, next[MAXBITS + 2];
+	for (int i = 0; i < n; i++)
+		count[lens[i]]++;
+	count[0] = 0;
+	next[1] = 0;
+	for (int len = 1; len <= MAXBITS; len++)
+		next[len + 1] = (next[len] + count[len]) << 1;
+	for (int i = 0; i < n; i++) {
+		int len = lens[i];
+		if (!len)
+			continue;
+		UWORD c = next[len]++, r = 0;
+		for (int j = 0; j < len; j++) {
+			r = (r << 1) | (c & 1);
+			c >>= 1;
+		}
+		codes[i] = r;
+	}
+}
+
+static void static_lengths(UBYTE *litlen, UBYTE *distlen)
+{
+	for (int i = 0; i < 288; i++)
+		litlen[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+	for (int i = 0; i < 32; i++)
+		distlen[i] = 5;
+}
+
+/* Dynamic block header */
+
+struct dynheader
+{
+	int hlit, hdist, hclen;
+	UBYTE codelen[19];
+	UWORD codes[19];
+	int n;
+	UBYTE sym[NLITLEN + NDIST];
+	UBYTE extra[NLITLEN + NDIST];
+};
+
+static void dynheader_build(struct dynheader *dh, const UBYTE *litlen, const UBYTE *distlen)
+{
+	UBYTE all[NLITLEN + NDIST];
+	ULONG freq[19] = { 0 };
+	int total;
+
+	dh->hlit = NLITLEN;
+	while (dh->hlit > 257 && !litlen[dh->hlit - 1])
+		dh->hlit--;
+	dh->hdist = NDIST;
+	while (dh->hdist > 1 && !distlen[dh->hdist - 1])
+		dh->hdist--;
+	memcpy(all, litlen, dh->hlit);
+	memcpy(all + dh->hlit, distlen, dh->hdist);
+	total = dh->hlit + dh->hdist;
+
+	dh->n = 0;
+	for (int i = 0; i < total;) {
+		int v = all[i], run = 1;
+		while (i + run < total && all[i + run] == v)
+			run++;
+		if (!v && run >= 11) {
+			run = run > 138 ? 138 : run;
+			dh->sym[dh->n] = 18;
+			dh->extra[dh->n++] = run - 11;
+		} else if (!v && run >= 3) {
+			dh->sym[dh->n] = 17;
+			dh->extra[dh->n++] = run - 3;
+		} else if (v && i > 0 && all[i - 1] == v && run >= 3) {
+			run = run > 6 ? 6 : run;
+			dh->sym[dh->n] = 16;
+			dh->extra[dh->n++] = run - 3;
+		} else {
+			run = 1;
+			dh->sym[dh->n] = v;
+			dh->extra[dh->n++] = 0;
+		}
+		i += run;
+	}
+	for (int i = 0; i < dh->n; i++)
+		freq[dh->sym[i]]++;
+	int used = 0;
+	for (int i = 0; i < 19; i++)
+		used += freq[i] != 0;
+	for (int i = 0; used < 2; i++) {
+		if (!freq[i]) {
+			freq[i] = 1;
+			used++;
+		}
+	}
+	huffman_lengths(freq, 19, MAXBITS_CODELEN, dh->codelen);
+	huffman_codes(dh->codelen, 19, dh->codes);
+	dh->hclen = 19;
+	while (dh->hclen > 4 && !dh->codelen[codelen_order[dh->hclen - 1]])
+		dh->hclen--;
+}
+
+static ULONG dynheader_bits(const struct dynheader *dh)
+{
+	static const UBYTE rle_extra[3] = { 2, 3, 7 };
+	ULONG bits = 5 + 5 + 4 + dh->hclen * 3;
+	for (int i = 0; i < dh->n; i++)
+		bits += dh->codelen[dh->sym[i]] + (dh->sym[i] >= 16 ? rle_extra[dh->sym[i] - 16] : 0);
+	return bits;
+}
+
+/* Bit writer */
+
+struct bitwriter
+{
+	UBYTE *p;
+	uint64_t acc;
+	int n;
+};
+
+static void putbits(struct bitwriter *bw, ULONG v, int n)
+{
+	bw->acc |= (uint64_t)v << bw->n;
+	bw->n += n;
+	while (bw->n >= 8) {
+		*bw->p++ = bw->acc;
+		bw->acc >>= 8;
+		bw->n -= 8;
+	}
+}
+
+static void alignbits(struct bitwriter *bw)
+{
+	if (bw->n)
+		putbits(bw, 0, 8 - bw->n);
+}
+
+/* Parser */
+
+struct token
+{
+	UWORD len;	// 0 = literal
+	UWORD val;	// literal or distance
+};
+
+struct job
+{
+	ULONG start, len;
+	struct token *tokens;
+	ULONG ntokens;
+	int type;
+	UBYTE litlen[288], distlen[32];
+};
+
+struct encoder
+{
+	const UBYTE *src;
+	ULONG len;
+	ULONG cpb;
+	struct job *jobs;
+	int njobs;
+	int next;
+	pthread_mutex_t lock;
+};
+
+// parser costs: bits * cycles per bit + decode cycles
+struct costs
+{
+	ULONG lit[256];
+	ULONG len[MAXMATCH + 1];
+	ULONG dist[NDIST];
+};
+
+static void set_costs(struct costs *c, const UBYTE *litlen, const UBYTE *distlen, ULONG cpb)
+{
+	UBYTE ll[NLITLEN], dl[NDIST];
+	int maxl = 0, maxd = 0;
+
+	// unused symbols: a bit longer than the longest used code
+	for (int i = 0; i < NLITLEN; i++)
+		maxl = litlen[i] > maxl ? litlen[i] : maxl;
+	for (int i = 0; i < NDIST; i++)
+		maxd = distlen[i] > maxd ? distlen[i] : maxd;
+	for (int i = 0; i < NLITLEN; i++)
+		ll[i] = litlen[i] ? litlen[i] : (maxl < MAXBITS ? maxl + 1 : MAXBITS);
+	for (int i = 0; i < NDIST; i++)
+		dl[i] = distlen[i] ? distlen[i] : (maxd < MAXBITS ? maxd + 1 : MAXBITS);
+
+	int pairs = pair_mode(ll);
+	for (int i = 0; i < 256; i++) {
+		c->lit[i] = ll[i] * cpb + tree_cycles(ll[i]);
+		// short codes usually decode as a pair
+		c->lit[i] += pairs && ll[i] <= TABLE_BITS / 2 ? CYC_PAIR / 2 : CYC_LITERAL;
+	}
+	for (int i = MINMATCH; i <= MAXMATCH; i++) {
+		int s = length_symbol(i);
+		c->len[i] = (ll[257 + s] + length_extra[s]) * cpb + tree_cycles(ll[257 + s]) + CYC_MATCH;
+	}
+	for (int i = 0; i < NDIST; i++)
+		c->dist[i] = (dl[i] + dist_extra[i]) * cpb + tree_cycles(dl[i]);
+}
+
+static int wide_dist(ULONG dist)
+{
+	return dist == 1 || (dist >= 4 && !(dist & 1));
+}
+
+struct matches
+{
+	UBYTE *n;
+	UWORD *len;
+	UWORD *dist;
+};
+
+// Collect matches for every block position: each longer match found, with
+// the nearest distance, and longer matches at distances the wide copy can
+// use if the overall longest one can't.
+static void find_matches(const UBYTE *src, ULONG srclen, ULONG start, ULONG len, struct matches *m)
+{
+	ULONG base = start > WSIZE ? start - WSIZE : 0;
+	ULONG end = start + len;
+	LONG *head = malloc((1 << HASHBITS) * sizeof(LONG));
+	LONG *prev = malloc((end - base) * sizeof(LONG));
+
+	memset(head, 0xff, (1 << HASHBITS) * sizeof(LONG));
+	for (ULONG p = base; p < end; p++) {
+		ULONG maxlen = end - p < MAXMATCH ? end - p : MAXMATCH;
+		if (p + MINMATCH > srclen) {
+			if (p >= start)
+				m->n[p - start] = 0;
+			continue;
+		}
+		ULONG h = ((src[p] << 16) | (src[p + 1] << 8) | src[p + 2]) * 2654435761U >> (32 - HASHBITS);
+		if (p >= start) {
+			ULONG i = p - start, best = MINMATCH - 1, bestdist = 0, widebest = 15;
+			int n = 0;
+			LONG cand = head[h];
+			for (int chain = 0; cand >= 0 && p - cand <= WSIZE && chain < MAXCHAIN && maxlen >= MINMATCH; chain++) {
+				ULONG dist = p - cand;
+				int wide = wide_dist(dist);
+				ULONG need = best;
+				if (wide && best >= 16 && widebest < best)
+					need = widebest;
+				if (need < maxlen && src[cand + need] == src[p + need]) {
+					ULONG l = 0;
+					while (l < maxlen && src[cand + l] == src[p + l])
+						l++;
+					if (l > best) {
+						if (n == MAXCAND)
+							n--;
+						m->len[i * MAXCAND + n] = l;
+						m->dist[i * MAXCAND + n] = dist;
+						n++;
+						best = l;
+						bestdist = dist;
+						if (wide && l > widebest)
+							widebest = l;
+					} else if (wide && l > widebest && n < MAXCAND) {
+						m->len[i * MAXCAND + n] = l;
+						m->dist[i * MAXCAND + n] = dist;
+						n++;
+						widebest = l;
+					}
+					if (best == maxlen && (wide_dist(bestdist) || widebest == maxlen))
+						break;
+				}
+				cand = prev[cand - base];
+			}
+			m->n[i] = n;
+		}
+		prev[p - base] = head[h];
+		head[h] = p;
+	}
+	free(head);
+	free(prev);
+}
+
+// minimum cost parse of the block, backwards
+static ULONG parse(const UBYTE *src, const struct costs *c, const struct matches *m, ULONG len,
+	ULONG *cost, UWORD *clen, UWORD *cdist, struct token *tokens)
+{
+	cost[len] = 0;
+	for (LONG p = len - 1; p >= 0; p--) {
+		ULONG best = c->lit[src[p]] + cost[p + 1];
+		UWORD bl = 0, bd = 0;
+		int n = m->n[p];
+		ULONG done = MINMATCH - 1;
+		if (n && m->len[p * MAXCAND + n - 1] >= NICEMATCH) {
+			// long match: no point in trying the shorter ones
+			ULONG l = m->len[p * MAXCAND + n - 1], d = m->dist[p * MAXCAND + n - 1];
+			best = c->len[l] + c->dist[dist_symbol(d)] + copy_cycles(l, d) + cost[p + l];
+			bl = l;
+			bd = d;
+			n = 0;
+		}
+		for (int i = 0; i < n; i++) {
+			ULONG l = m->len[p * MAXCAND + i], d = m->dist[p * MAXCAND + i];
+			ULONG dc = c->dist[dist_symbol(d)];
+			// shorter matches are cheapest at the nearer distances found
+			// before, except for the wide copy
+			ULONG from = l > done ? done + 1 : 16;
+			for (ULONG k = from; k <= l; k++) {
+				ULONG v = c->len[k] + dc + copy_cycles(k, d) + cost[p + k];
+				if (v < best) {
+					best = v;
+					bl = k;
+					bd = d;
+				}
+			}
+			if (l > done)
+				done = l;
+		}
+		cost[p] = best;
+		clen[p] = bl;
+		cdist[p] = bd;
+	}
+	ULONG nt = 0;
+	for (ULONG p = 0; p < len;) {
+		if (clen[p]) {
+			tokens[nt].len = clen[p];
+			tokens[nt++].val = cdist[p];
+			p += clen[p];
+		} else {
+			tokens[nt].len = 0;
+			tokens[nt++].val = src[p++];
+		}
+	}
+	return nt;
+}
+
+static void token_freq(const struct token *t, ULONG n, ULONG *lfreq, ULONG *dfreq)
+{
+	memset(lfreq, 0, NLITLEN * sizeof(ULONG));
+	memset(dfreq, 0, NDIST * sizeof(ULONG));
+	for (ULONG i = 0; i < n; i++) {
+		if (t[i].len) {
+			lfreq[257 + length_symbol(t[i].len)]++;
+			dfreq[dist_symbol(t[i].val)]++;
+		} else {
+			lfreq[t[i].val]++;
+		}
+	}
+	lfreq[EOB] = 1;
+}
+
+// block data bits and decode cycles with the given code
+static uint64_t block_cost(const struct token *t, ULONG n, const UBYTE *litlen, const UBYTE *distlen, ULONG cpb, uint64_t *bitsp)
+{
+	struct cyclecount cc = { 0, pair_mode(litlen), 0, 0 };
+	uint64_t bits = litlen[EOB];
+	for (ULONG i = 0; i < n; i++) {
+		if (t[i].len) {
+			int ls = length_symbol(t[i].len), ds = dist_symbol(t[i].val);
+			bits += litlen[257 + ls] + length_extra[ls] + distlen[ds] + dist_extra[ds];
+			cc_match(&cc, litlen[257 + ls], distlen[ds], t[i].len, t[i].val);
+		} else {
+			bits += litlen[t[i].val];
+			cc_literal(&cc, litlen[t[i].val]);
+		}
+	}
+	cc_flush(&cc);
+	*bitsp = bits;
+	return bits * cpb + cc.cycles;
+}
+
+static void compress_job(struct encoder *e, struct job *j)
+{
+	const UBYTE *src = e->src + j->start;
+	struct matches m;
+	struct costs c;
+	ULONG lfreq[NLITLEN], dfreq[NDIST];
+	ULONG *cost = malloc((j->len + 1) * sizeof(ULONG));
+	UWORD *clen = malloc(j->len * sizeof(UWORD));
+	UWORD *cdist = malloc(j->len * sizeof(UWORD));
+
+	m.n = malloc(j->len);
+	m.len = malloc(j->len * MAXCAND * sizeof(UWORD));
+	m.dist = malloc(j->len * MAXCAND * sizeof(UWORD));
+	j->tokens = malloc(j->len * sizeof(struct token));
+	find_matches(e->src, e->len, j->start, j->len, &m);
+
+	// first pass: literal code from the byte histogram, static code for
+	// lengths and distances
+	static_lengths(j->litlen, j->distlen);
+	memset(lfreq, 0, sizeof lfreq);
+	for (ULONG i = 0; i < j->len; i++)
+		lfreq[src[i]]++;
+	lfreq[EOB] = 1;
+	UBYTE hist[NLITLEN];
+	huffman_lengths(lfreq, 257, MAXBITS, hist);
+	memcpy(j->litlen, hist, 256);
+	for (int pass = 0; pass < PASSES; pass++) {
+		set_costs(&c, j->litlen, j->distlen, e->cpb);
+		j->ntokens = parse(src, &c, &m, j->len, cost, clen, cdist, j->tokens);
+		token_freq(j->tokens, j->ntokens, lfreq, dfreq);
+		int used = 0;
+		for (int i = 0; i < NDIST; i++)
+			used += dfreq[i] != 0;
+		for (int i = 0; used < 2; i++) {
+			if (!dfreq[i]) {
+				dfreq[i] = 1;
+				used++;
+			}
+		}
+		huffman_lengths(lfreq, NLITLEN, MAXBITS, j->litlen);
+		memset(j->litlen + NLITLEN, 0, 288 - NLITLEN);
+		huffman_lengths(dfreq, NDIST, MAXBITS, j->distlen);
+		memset(j->distlen + NDIST, 0, 32 - NDIST);
+	}
+
+	// cheapest block type for the final parse. Stored blocks always
+	// decode fastest but are only used if they are not larger either,
+	// the whole state file must fit in memory before decompression.
+	struct dynheader dh;
+	UBYTE slit[288], sdist[32];
+	uint64_t dynbits, statbits;
+	dynheader_build(&dh, j->litlen, j->distlen);
+	uint64_t dyn = block_cost(j->tokens, j->ntokens, j->litlen, j->distlen, e->cpb, &dynbits) +
+		(3 + dynheader_bits(&dh)) * e->cpb + CYC_BLOCK + CYC_DYNAMIC;
+	dynbits += 3 + dynheader_bits(&dh);
+	// the static table cache only helps later static blocks
+	static_lengths(slit, sdist);
+	uint64_t stat = block_cost(j->tokens, j->ntokens, slit, sdist, e->cpb, &statbits) +
+		3 * e->cpb + CYC_BLOCK + CYC_STATIC_BUILD;
+	statbits += 3;
+	ULONG pieces = (j->len + STORED_MAX - 1) / STORED_MAX;
+	uint64_t storedbits = (uint64_t)j->len * 8 + pieces * 40;
+	j->type = BLOCK_DYNAMIC;
+	if (stat < dyn) {
+		j->type = BLOCK_STATIC;
+		memcpy(j->litlen, slit, 288);
+		memcpy(j->distlen, sdist, 32);
+		dynbits = statbits;
+	}
+	if (storedbits <= dynbits)
+		j->type = BLOCK_STORED;
+
+	free(m.n);
+	free(m.len);
+	free(m.dist);
+	free(cost);
+	free(clen);
+	free(cdist);
+}
+
+static void *compress_thread(void *arg)
+{
+	struct encoder *e = arg;
+	for (;;) {
+		pthread_mutex_lock(&e->lock);
+		int i = e->next++;
+		pthread_mutex_unlock(&e->lock);
+		if (i >= e->njobs)
+			break;
+		compress_job(e, &e->jobs[i]);
+	}
+	return NULL;
+}
+
+static void write_block(struct bitwriter *bw, const UBYTE *src, struct job *j, int final)
+{
+	if (j->type == BLOCK_STORED) {
+		for (ULONG pos = 0; pos < j->len; pos += STORED_MAX) {
+			ULONG n = j->len - pos < STORED_MAX ? j->len - pos : STORED_MAX;
+			putbits(bw, final && pos + n == j->len, 1);
+			putbits(bw, 0, 2);
+			alignbits(bw);
+			putbits(bw, n, 16);
+			putbits(bw, n ^ 0xffff, 16);
+			memcpy(bw->p, src + j->start + pos, n);
+			bw->p += n;
+		}
+		return;
+	}
+
+	UWORD lcodes[288], dcodes[32];
+	huffman_codes(j->litlen, 288, lcodes);
+	huffman_codes(j->distlen, 32, dcodes);
+	putbits(bw, final, 1);
+	putbits(bw, j->type, 2);
+	if (j->type == BLOCK_DYNAMIC) {
+		static const UBYTE rle_extra[3] = { 2, 3, 7 };
+		struct dynheader dh;
+		dynheader_build(&dh, j->litlen, j->distlen);
+		putbits(bw, dh.hlit - 257, 5);
+		putbits(bw, dh.hdist - 1, 5);
+		putbits(bw, dh.hclen - 4, 4);
+		for (int i = 0; i < dh.hclen; i++)
+			putbits(bw, dh.codelen[codelen_order[i]], 3);
+		for (int i = 0; i < dh.n; i++) {
+			int s = dh.sym[i];
+			putbits(bw, dh.codes[s], dh.codelen[s]);
+			if (s >= 16)
+				putbits(bw, dh.extra[i], rle_extra[s - 16]);
+		}
+	}
+	for (ULONG i = 0; i < j->ntokens; i++) {
+		struct token *t = &j->tokens[i];
+		if (t->len) {
+			int ls = length_symbol(t->len), ds = dist_symbol(t->val);
+			putbits(bw, lcodes[257 + ls], j->litlen[257 + ls]);
+			putbits(bw, t->len - length_base[ls], length_extra[ls]);
+			putbits(bw, dcodes[ds], j->distlen[ds]);
+			putbits(bw, t->val - dist_base[ds], dist_extra[ds]);
+		} else {
+			putbits(bw, lcodes[t->val], j->litlen[t->val]);
+		}
+	}
+	putbits(bw, lcodes[EOB], j->litlen[EOB]);
+}
+
+ULONG deflate_bound(ULONG len)
+{
+	return len + len / 1000 + 1024;
+}
+
+// compress len bytes from src to dst as a zlib stream, returns its size
+ULONG deflate_fast(UBYTE *dst, const UBYTE *src, ULONG len, ULONG cyclesperbit, int threads)
+{
+	struct encoder e;
+	struct bitwriter bw;
+
+	e.src = src;
+	e.len = len;
+	e.cpb = cyclesperbit + CYC_BIT;
+	e.njobs = (len + BLOCKSIZE - 1) / BLOCKSIZE;
+	e.jobs = calloc(e.njobs ? e.njobs : 1, sizeof(struct job));
+	e.next = 0;
+	pthread_mutex_init(&e.lock, NULL);
+	for (int i = 0; i < e.njobs; i++) {
+		e.jobs[i].start = i * BLOCKSIZE;
+		e.jobs[i].len = len - i * BLOCKSIZE < BLOCKSIZE ? len - i * BLOCKSIZE : BLOCKSIZE;
+	}
+	if (threads > e.njobs)
+		threads = e.njobs;
+	if (threads < 1)
+		threads = 1;
+	pthread_t *tids = malloc(threads * sizeof(pthread_t));
+	for (int i = 1; i < threads; i++)
+		pthread_create(&tids[i], NULL, compress_thread, &e);
+	compress_thread(&e);
+	for (int i = 1; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	pthread_mutex_destroy(&e.lock);
+
+	bw.p = dst;
+	bw.acc = 0;
+	bw.n = 0;
+	// 32k window, maximum compression
+	putbits(&bw, 0x78, 8);
+	putbits(&bw, 0xda, 8);
+	if (!e.njobs) {
+		// empty static block
+		putbits(&bw, 1 | (BLOCK_STATIC << 1), 3);
+		putbits(&bw, 0, 7);
+	}
+	for (int i = 0; i < e.njobs; i++) {
+		write_block(&bw, src, &e.jobs[i], i == e.njobs - 1);
+		free(e.jobs[i].tokens);
+	}
+	alignbits(&bw);
+	ULONG adler = adler32(adler32(0, NULL, 0), src, len);
+	for (int i = 24; i >= 0; i -= 8)
+		*bw.p++ = adler >> i;
+	free(e.jobs);
+	return bw.p - dst;
+}
+
+/* Decode time estimator */
+
+struct bitreader
+{
+	const UBYTE *p, *end;
+	ULONG acc;
+	int n;
+	int error;
+};
+
+static ULONG getbits(struct bitreader *br, int n)
+{
+	while (br->n < n) {
+		if (br->p >= br->end) {
+			br->error = 1;
+			return 0;
+		}
+		br->acc |= (ULONG)*br->p++ << br->n;
+		br->n += 8;
+	}
+	ULONG v = br->acc & ((1UL << n) - 1);
+	br->acc >>= n;
+	br->n -= n;
+	return v;
+}
+
+struct huffman
+{
+	UWORD count[MAXBITS + 1];
+	UWORD symbol[288];
+};
+
+static int huffman_build(struct huffman *h, const UBYTE *lens, int n)
+{
+	UWORD offs[MAXBITS + 1];
+	memset(h->count, 0, sizeof h->count);
+	for (int i = 0; i < n; i++)
+		h->count[lens[i]]++;
+	h->count[0] = 0;
+	offs[1] = 0;
+	for (int len = 1; len < MAXBITS; len++)
+		offs[len + 1] = offs[len] + h->count[len];
+	for (int i = 0; i < n; i++) {
+		if (lens[i])
+			h->symbol[offs[lens[i]]++] = i;
+	}
+	return 1;
+}
+
+// returns symbol, *bits = code length
+static int huffman_decode(struct bitreader *br, const struct huffman *h, int *bits)
+{
+	int code = 0, first = 0, index = 0;
+	for (int len = 1; len <= MAXBITS; len++) {
+		code |= getbits(br, 1);
+		int count = h->count[len];
+		if (code - count < first) {
+			*bits = len;
+			return h->symbol[index + (code - first)];
+		}
+		index += count;
+		first += count;
+		first <<= 1;
+		code <<= 1;
+	}
+	br->error = 1;
+	return -1;
+}
+
+// Estimate 68000 ussload decode cycles of zlib stream zs (size bytes),
+// len = decompressed size. Returns FALSE if the stream is not valid.
+int deflate_predict(const UBYTE *zs, ULONG size, ULONG len, struct deflatestats *ds)
+{
+	struct bitreader br = { zs + 2, zs + size, 0, 0, 0 };
+	struct cyclecount cc = { 0, 0, 0, 0 };
+	struct huffman lh, dh;
+	UBYTE litlen[288 + 32], distlen[32];
+	ULONG out = 0;
+	int last, statics = 0;
+
+	memset(ds, 0, sizeof(struct deflatestats));
+	if (size < 6 || (zs[0] & 0x0f) != 8 || (zs[1] & 0x20) || ((zs[0] << 8) | zs[1]) % 31)
+		return 0;
+	do {
+		last = getbits(&br, 1);
+		int type = getbits(&br, 2);
+		ds->blocks++;
+		ds->types[type]++;
+		cc.cycles += CYC_BLOCK;
+		if (type == BLOCK_STORED) {
+			br.acc = 0;
+			br.n = 0;
+			if (br.end - br.p < 4)
+				return 0;
+			ULONG n = br.p[0] | (br.p[1] << 8);
+			br.p += 4;
+			if (n > br.end - br.p)
+				return 0;
+			br.p += n;
+			out += n;
+			cc.cycles += n * CYC_STORED;
+			continue;
+		}
+		if (type == BLOCK_STATIC) {
+			static_lengths(litlen, distlen);
+			if (statics++)
+				ds->cached++;
+			cc.cycles += statics > 1 ? CYC_STATIC_CACHED : CYC_STATIC_BUILD;
+		} else if (type == BLOCK_DYNAMIC) {
+			UBYTE cl[19] = { 0 };
+			struct huffman ch;
+			int hlit = getbits(&br, 5) + 257, hdist = getbits(&br, 5) + 1, hclen = getbits(&br, 4) + 4;
+			for (int i = 0; i < hclen; i++)
+				cl[codelen_order[i]] = getbits(&br, 3);
+			huffman_build(&ch, cl, 19);
+			memset(litlen, 0, sizeof litlen);
+			for (int i = 0; i < hlit + hdist && !br.error;) {
+				int bits, s = huffman_decode(&br, &ch, &bits), v = 0, rep = 1;
+				if (s < 16) {
+					v = s;
+				} else if (s == 16) {
+					if (!i)
+						return 0;
+					v = litlen[i - 1];
+					rep = 3 + getbits(&br, 2);
+				} else if (s == 17) {
+					rep = 3 + getbits(&br, 3);
+				} else {
+					rep = 11 + getbits(&br, 7);
+				}
+				if (i + rep > hlit + hdist)
+					return 0;
+				while (rep--)
+					litlen[i++] = v;
+			}
+			memcpy(distlen, litlen + hlit, hdist);
+			memset(distlen + hdist, 0, 32 - hdist);
+			memset(litlen + hlit, 0, 288 - hlit);
+			cc.cycles += CYC_DYNAMIC;
+		} else {
+			return 0;
+		}
+		huffman_build(&lh, litlen, 288);
+		huffman_build(&dh, distlen, 32);
+		cc.pairmode = pair_mode(litlen);
+		for (;;) {
+			int lbits, dbits;
+			int s = huffman_decode(&br, &lh, &lbits);
+			if (br.error)
+				return 0;
+			if (lbits > TABLE_BITS)
+				ds->treewalks++;
+			if (s < 256) {
+				cc_literal(&cc, lbits);
+				ds->literals++;
+				out++;
+				continue;
+			}
+			if (s == EOB)
+				break;
+			s -= 257;
+			if (s >= 29)
+				return 0;
+			ULONG l = length_base[s] + getbits(&br, length_extra[s]);
+			int d = huffman_decode(&br, &dh, &dbits);
+			if (d < 0 || d >= 30)
+				return 0;
+			ULONG dist = dist_base[d] + getbits(&br, dist_extra[d]);
+			if (dist > out)
+				return 0;
+			if (dbits > TABLE_BITS)
+				ds->treewalks++;
+			int bucket = 0;
+			for (ULONG v = l >> 2; v; v >>= 1)
+				bucket++;
+			ds->lengths[bucket]++;
+			ds->matches++;
+			cc_match(&cc, lbits, dbits, l, dist);
+			out += l;
+		}
+		cc_flush(&cc);
+	} while (!last && !br.error);
+	ds->cycles = cc.cycles + (uint64_t)(br.p - zs) * 8 * CYC_BIT;
+	ds->pairs = cc.pairs;
+	return !br.error && out == len;
+}
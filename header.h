@@ -1,5 +1,5 @@
 
-#define TEMP_STACK_SIZE 6000
+#define TEMP_STACK_SIZE 7000
 
 #define ALLOCATIONS 64
 
@@ -18,6 +18,12 @@ struct MemoryBank
 	ULONG size;
 	ULONG targetsize;
 	ULONG offset;
+	ULONG inplacesize; // in place decompression needs this much target space, 0 = not possible
+	UBYTE *remapaddr; // whole bank MMU remapped to this physical RAM
+	UBYTE *staged; // decompressed before system take over
+	UBYTE *delta; // changed pages from delta state file (CHUNK_DELTA)
+	UBYTE **blockstage; // CHUNK_BLOCKS: blocks decompressed before take over, NULL = not staged
+	UBYTE lazy; // CHUNK_BLOCKS: blocks decompressed on first access after take over
 	UBYTE chunk[5];
 };
 
@@ -65,6 +71,106 @@ struct extraram
 	struct MemHeader *head;
 };
 
+// memory chunk flags. LZ4 is an ussload extension (usspack), set with
+// CHUNK_COMPRESSED: decompressed size, LZ4 block, Adler-32 of the data.
+#define CHUNK_COMPRESSED 1
+#define CHUNK_LZ4 0x100
+// Sparse is an ussload extension too: size, page size, number of data
+// pages, page bitmap (MSB first, set = data page, padded to longword),
+// one fill longword per other page, then the data pages as uncompressed,
+// zlib or LZ4 data as selected by the other flags.
+#define CHUNK_SPARSE 0x200
+// Delta (usspack -d): size, page size, number of changed pages, page
+// bitmap (set = changed page), then the changed pages uncompressed. Only
+// in delta state files, copied over the base state file bank.
+#define CHUNK_DELTA 0x400
+// Bundle state memory chunk (usspack -b): size, then one page number per
+// page, BUNDLE_ZERO = zero filled page. Only seen by ussfile.c, loaded as
+// uncompressed memory chunk.
+#define CHUNK_PAGES 0x800
+// Blocks (usspack -B), set with CHUNK_COMPRESSED: size, block size, number
+// of blocks, block offsets from the start of the data (blocks + 1), then
+// the blocks. Each block is zlib or LZ4 + Adler-32 (as CHUNK_LZ4 without
+// the size), or only its fill longword if it is 4 bytes.
+#define CHUNK_BLOCKS 0x1000
+// FPU chunk of a native state file: registers already in 12 byte extended
+// format (fpu_process() output), not 10 byte.
+#define CHUNK_FPU12 0x2000
+
+// Bundle file: "USSB", number of entries, page size, page index offset.
+// Entries: name (NUL padded), type, offset, size. State entries point
+// to a state file where memory chunks are CHUNK_PAGES. Page index: number
+// of stored pages, file offset of each page and of the end. A page shorter
+// than the page size is an LZ4 block (as CHUNK_LZ4 without size and
+// Adler-32), others are uncompressed.
+#define BUNDLE_HEAD 16
+#define BUNDLE_ENTRY 48
+#define BUNDLE_NAME 36
+#define BUNDLE_STATE 0
+#define BUNDLE_ROM 1
+#define BUNDLE_ZERO 0xffffffff
+
+// Native state file (usspack -N): "USSN", state file stream offset, number
+// of entries, size of the small chunks at the start of the stream. Entries:
+// chunk header (name, size, flags), stream offset, first data bytes. The
+// stream has all other chunks first, then memory chunks in load order with
+// their data page aligned in the file ("PAD " chunks in between), END last.
+#define NATIVE_HEAD 16
+#define NATIVE_ENTRY 32
+#define NATIVE_PREFIX 16
+#define NATIVE_PAGE 4096
+
+// inflate staging window (see OPT_WINDOW in inflate.S)
+#define STAGING_WINDOW 32768
+#define STAGING_MIN (3 * STAGING_WINDOW + 512)
+// check only decoding window, bigger = less history sliding
+#define VERIFY_WINDOW (8 * STAGING_WINDOW)
+
+// inflate work area: stack holds lookup tables, 9-bit tables need ~6k
+#define INFLATE_STACK_SIZE 8192
+// static huffman table cache (see OPT_PREGENERATE_TABLES in inflate.S)
+#define INFLATE_TABLES_SIZE 6144
+
+// inflate decode profile (OPT_STATS in inflate.S, make STATS=1)
+struct inflatestats
+{
+	ULONG blocks[4]; // stored, static, dynamic, invalid
+	ULONG cached; // static blocks decoded from the table cache
+	ULONG literals;
+	ULONG pairs;
+	ULONG matches;
+	ULONG treewalks;
+	ULONG lengths[8]; // match length 3, 4-7, 8-15, .., 256-258
+};
+
+// inflate context (see OPT_WINDOW and OPT_PREGENERATE_TABLES in inflate.S)
+struct inflatecontext
+{
+	UBYTE *dst;
+	UBYTE *buf;
+	UBYTE *flushed;
+	UBYTE *limit;
+	UBYTE *tables;
+	ULONG tablessize;
+	ULONG (*sink)(ULONG, UBYTE*, ULONG); // output is passed to sink, not flushed to dst
+	ULONG sinkdata; // sink argument and result
+	struct inflatestats stats;
+	ULONG burst; // output (buf, or dst if no buf) takes MOVE16 line writes
+};
+
+// RAM in the 32-bit address space: never Chip or 24-bit bus RAM, safe for
+// MOVE16 burst writes (inflatecontext burst)
+#define BURST_RAM(p) ((ULONG)(p) >= 0x01000000)
+
+// regions temporarily copyback cached during decompression (68040/060 MMU mode)
+#define MAX_COPYBACK 5
+
+struct cbregion
+{
+	UBYTE *addr;
+	ULONG size;
+};
+
 #define HWTYPE_GENERIC 0
 #define HWTYPE_CDTV 1
 #define HWTYPE_CD32 2
@@ -85,6 +191,7 @@ struct uaestate
 	ULONG *MMU_Level_A;
 	UBYTE *vbr;
 	UBYTE *debug_entry;
+	ULONG (*lazyfault)(UBYTE*, struct uaestate*); // relocated lazy_fault(), 0 = not lazy
 
 	UBYTE *maprom;
 	ULONG mapromsize;
@@ -116,11 +223,70 @@ struct uaestate
 	UBYTE nowait;
 	UBYTE canusemmu;
 	UBYTE mmuused;
+	UBYTE bench;
+	UWORD benchmhz;
+	UBYTE verify;
+	UBYTE lazy; // lazy restore requested, number of lazy banks after lazy_banks()
+	UBYTE *zeropage; // shared write protected zero page of lazy banks
+	UBYTE *chipwindow;
+	ULONG chipwindowsize;
+	UBYTE *inflatework;
+	struct inflatecontext inflatectx;
+	struct cbregion copyback[MAX_COPYBACK];
+	struct ussfile *file; // memory chunk reads may be in flight until uss_wait()
 };
 
+// FOURCC chunk id
+#define CHUNK_ID(a, b, c, d) (((ULONG)(a) << 24) | ((ULONG)(b) << 16) | ((ULONG)(c) << 8) | (ULONG)(d))
+
+// State chunks are read and kept up to maxsize (0 = whole chunk) by pass 1
+// and loaded to their uaestate slot in pass 2. Memory chunks: only their
+// compression header is read in pass 1, index is the memory bank.
+// Unsupported chunks are errors, unknown chunks are skipped.
+#define CHUNKTYPE_STATE 0
+#define CHUNKTYPE_MEMORY 1
+#define CHUNKTYPE_UNSUPPORTED 2
+
+// memory chunk bytes read by parse pass 1 (compression header)
+#define CHUNK_HEADSIZE 16
+
+// chunk registry entry (main.c chunktypes[])
+struct chunktype
+{
+	ULONG id;
+	UBYTE kind;
+	ULONG maxsize; // bytes read by pass 1 and kept by the state file reader, 0 = all
+	UBYTE index; // drive number or memory bank
+	UWORD slot; // offsetof(struct uaestate, ...), 0 = not loaded in pass 2
+	void (*check)(UBYTE *p, struct uaestate *st); // pass 1, not in early check
+	void (*load)(UBYTE *p, ULONG flags, int index, struct uaestate *st); // pass 2, after loading
+};
+
+const struct chunktype *find_chunktype(const UBYTE *cname);
+
 UBYTE *extra_allocate(ULONG size, ULONG alignment, struct uaestate *st);
 
 BOOL map_region(struct uaestate *st, void *addr, void *physaddr, ULONG size, BOOL invalid, BOOL writeprotect, BOOL supervisor, UBYTE cachemode);
+BOOL map_region_tables(struct uaestate *st, void *addr, ULONG size);
 BOOL unmap_region(struct uaestate *st, void *addr, ULONG size);
+BOOL tag_region(struct uaestate *st, void *addr, ULONG size, ULONG tag);
+ULONG mmu_page(struct uaestate *st, void *addr);
+BOOL mmu_map_pages(struct uaestate *st, void *addr, void *physaddr, ULONG size, BOOL writeprotect);
 BOOL init_mmu(struct uaestate *st);
+void mmu_add_copyback(struct uaestate *st, void *addr, ULONG size);
+void mmu_copyback(struct uaestate *st, BOOL enable);
+
 
+// state file reader, plain, gzip/zip container or bundle (ussfile.c)
+struct ussfile;
+struct ussfile *uss_open(const char *name, struct uaestate *st);
+void uss_close(struct ussfile *uf);
+ULONG uss_read(struct ussfile *uf, void *buf, ULONG size);
+void uss_seek(struct ussfile *uf, LONG offset, int whence);
+ULONG uss_tell(struct ussfile *uf);
+BOOL uss_load(struct ussfile *uf, ULONG offset, void *buf, ULONG size);
+BOOL uss_fetch(struct ussfile *uf);
+ULONG uss_rom(struct ussfile *uf, const char *name, void *buf);
+BOOL uss_wait(struct ussfile *uf, void *dst);
+void uss_poll(struct ussfile *uf);
+BOOL uss_readfile(const char *name, void *buf, ULONG size);
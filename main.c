@@ -8,8 +8,10 @@
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 
 #include <exec/types.h>
+#include <exec/memory.h>
 #include <exec/execbase.h>
 #include <proto/exec.h>
 #include <proto/graphics.h>
@@ -27,35 +29,6 @@ extern struct DosLibrary *DosBase;
 
 static const UBYTE *const version = "$VER: ussload " VER " (" REVDATE ")";
 
-static const char *const chunknames[] =
-{
-	"ASF ",
-	"CPU ", "FPU ", "CHIP", "AGAC",
-	"CIAA", "CIAB", "ROM ",
-	"DSK0", "DSK1", "DSK2", "DSK3",
-	"AUD0", "AUD1", "AUD2", "AUD3",
-	"SPR0", "SPR1", "SPR2", "SPR3",
-	"SPR4", "SPR5", "SPR6", "SPR7",
-	"CDTV", "DMAC", "CD32",
-	"END ",
-	NULL
-};
-static const char *const memchunknames[] =
-{
-	"CRAM", "BRAM", "FRAM",
-	NULL
-};
-static const char *const unsupportedchunknames[] =
-{
-	"FRA2", "FRA3", "FRA4",
-	"ZRA2", "ZRA3", "ZRA4",
-	"ZCRM", "PRAM",
-	"A3K1", "A3K2",
-	"BORO", "P96 ",
-	"FSYC",
-	NULL
-};
-
 static ULONG getlong(UBYTE *chunk, int offset)
 {
 	ULONG v;
@@ -794,6 +767,21 @@ static UBYTE *tempmem_allocate_reserved(ULONG size, WORD index, BOOL skip_unavai
 	}
 }
 
+// allocate statefile bank's chunk at the end of its own target space, decompressed in place
+static UBYTE *tempmem_allocate_inplace(ULONG size, WORD index, struct uaestate *st)
+{
+	struct MemoryBank *mb = &st->membanks[index];
+	if (!mb->inplacesize || mb->inplacesize < size)
+		return NULL;
+	ULONG offset = (mb->inplacesize - size + 7) & ~7;
+	if (offset + size > mb->targetsize)
+		return NULL;
+	UBYTE *b = AllocAbs(size, mb->targetaddr + offset);
+	if (b)
+		add_allocation(b, size, st);
+	return b;
+}
+
 static void debugtraps(UBYTE *vbr, struct uaestate *st)
 {
 	// NMI
@@ -816,26 +804,31 @@ static void debugtraps(UBYTE *vbr, struct uaestate *st)
 	}
 }
 
+// VBR table: vectors 2 to 47 jump through the vectors at address 0,
+// lazy restore bus error stub after them (lazy_vector())
+#define VBR_FIRST 2
+#define VBR_END 48
+#define VBR_LAZYSTUB (1024 + (VBR_END - VBR_FIRST) * 6)
+
 static void createvbr(struct uaestate *st)
 {
-	if (!st->debug_entry)
+	if (!st->debug_entry && !st->lazy)
 		return;
 	if (!(SysBase->AttnFlags & AFF_68010))
 		return;
-	WORD start = 2;
-	WORD end = 48;
-	st->vbr = tempmem_allocate(1024 + (end - start) * 6, FALSE, st);
+	st->vbr = tempmem_allocate(VBR_LAZYSTUB + 12, FALSE, st);
 	if (!st->vbr)
 		return;
 	UBYTE *p = st->vbr + 1024;
 	UBYTE *p2 = st->vbr;
-	for (WORD i = start; i < end; i++) {
+	for (WORD i = VBR_FIRST; i < VBR_END; i++) {
 		putlong(p2 + i * 4, (ULONG)p);
 		putlong(p + 0, 0x2f380000 + i * 4); // MOVE.L xxxx.w,-(SP)
 		putword(p + 4, 0x4e75); // RTS
 		p += 6;
 	}
-	debugtraps(p2, st);
+	if (st->debug_entry)
+		debugtraps(p2, st);
 }
 
 static void has_debugger(struct uaestate *st, BOOL force)
@@ -1323,11 +1316,12 @@ static void detect_type(struct uaestate *st)
 	}
 }
 
-static void load_rom(struct uaestate *st)
+static void load_rom(struct ussfile *uf, struct uaestate *st)
 {
 	UBYTE rompath[100], rompath2[100];
 	UBYTE *p;
 	FILE *f = NULL;
+	ULONG romsize = 0;
 	
 	if (!st->mrd[0].type && !st->mrd[1].type)
 		return;
@@ -1337,10 +1331,16 @@ static void load_rom(struct uaestate *st)
 		if (i)
 			agastate = !agastate;
 		sprintf(rompath, "DEVS:kickstarts/kick%d%03d.%s", st->romver, st->romrev, agastate ? "a1200" : "a500");
+		sprintf(rompath2, "kick%d%03d.%s", st->romver, st->romrev, agastate ? "a1200" : "a500");
+		// bundle can include ROM images
+		romsize = uss_rom(uf, rompath2, NULL);
+		if (romsize) {
+			p = rompath2;
+			break;
+		}
 		p = rompath;
 		f = fopen(rompath, "rb");
 		if (!f) {
-			sprintf(rompath2, "kick%d%03d.%s", st->romver, st->romrev, agastate ? "a1200" : "a500");
 			f = fopen(rompath2, "rb");
 			if (!f) {
 				printf("Couldn't open ROM image '%s'.\n", rompath);
@@ -1352,11 +1352,15 @@ static void load_rom(struct uaestate *st)
 		}
 		break;
 	}
-	if (!f)
+	if (!f && !romsize)
 		return;
-	fseek(f, 0, SEEK_END);
-	st->mapromsize = ftell(f);
-	fseek(f, 0, SEEK_SET);
+	if (romsize) {
+		st->mapromsize = romsize;
+	} else {
+		fseek(f, 0, SEEK_END);
+		st->mapromsize = ftell(f);
+		fseek(f, 0, SEEK_SET);
+	}
 	if (!st->maprom && !(st->maprom_memlimit & (1 << MB_CHIP)))
 		st->maprom = tempmem_allocate_reserved(st->mapromsize, MB_CHIP, TRUE, st);
 	if (!st->maprom && !(st->maprom_memlimit & (1 << MB_SLOW)))
@@ -1365,30 +1369,47 @@ static void load_rom(struct uaestate *st)
 		st->maprom = tempmem_allocate(st->mapromsize, TRUE, st);
 	if (!st->maprom) {
 		printf("Couldn't allocate %luk for ROM image '%s'.\n", st->mapromsize >> 10, p);
-		fclose(f);
+		if (f)
+			fclose(f);
 		return;
 	}
 	if (st->debug)
 		printf("MapROM temp %08lx-%08lx\n", st->maprom, st->maprom + st->mapromsize);
-	if (fread(st->maprom, 1, st->mapromsize, f) != st->mapromsize) {
+	if (f ? !uss_readfile(p, st->maprom, st->mapromsize) : uss_rom(uf, p, st->maprom) != romsize) {
 		printf("Read error while reading map rom image '%s'.\n", p);
-		fclose(f);
+		if (f)
+			fclose(f);
 		return;
 	}
-	fclose(f);
-	printf("ROM '%s' (%luk) loaded.\n", rompath, st->mapromsize >> 10);
+	if (f)
+		fclose(f);
+	printf("ROM '%s' (%luk) loaded%s.\n", f ? rompath : p, st->mapromsize >> 10, f ? "" : " from bundle");
+}
+
+// constant blocks are only filled, never decompressed
+static void blocks_info(const char *name, UBYTE *p)
+{
+	ULONG blocks = getlong(p, 8);
+	ULONG fill = 0;
+	for (ULONG i = 0; i < blocks; i++) {
+		if (getlong(p, 12 + i * 4 + 4) - getlong(p, 12 + i * 4) == 4)
+			fill++;
+	}
+	printf("Memory '%s' blocks, %lu x %luk: %lu data, %lu fill.\n", name, blocks, getlong(p, 4) >> 10, blocks - fill, fill);
 }
 
-static void load_memory(FILE *f, WORD index, struct uaestate *st)
+static void load_memory(struct ussfile *f, WORD index, struct uaestate *st)
 {
 	struct MemoryBank *mb = &st->membanks[index];
-	ULONG oldoffset = ftell(f);
 	ULONG chunksize = mb->size + 12;
-	fseek(f, mb->offset, SEEK_SET);
 	if (st->debug)
 		printf("Memory '%s', size %luk, offset %lu. Target %08lx.\n", mb->chunk, chunksize >> 10, mb->offset, mb->targetaddr);
+	// already allocated at the end of its own target space? Decompressed in place.
 	// if Chip RAM and free space in another statefile block? Put it there because chip ram is decompressed first.
-	if (index == MB_CHIP) {
+	if (mb->addr) {
+		if (st->debug)
+			printf(" - In place, target space used %luk.\n", mb->inplacesize >> 10);
+	} else if (index == MB_CHIP) {
 		mb->addr = tempmem_allocate_reserved(chunksize, MB_SLOW, FALSE, st);
 		if (!mb->addr)
 			mb->addr = tempmem_allocate_reserved(chunksize, MB_FAST, FALSE, st);
@@ -1400,18 +1421,18 @@ static void load_memory(FILE *f, WORD index, struct uaestate *st)
 	if (mb->addr) {
 		if (st->debug)
 			printf(" - Address %08lx - %08lx.\n", mb->addr, mb->addr + chunksize - 1);
-		if (fread(mb->addr, 1, chunksize, f) != chunksize) {
+		// container or indexed file: read later by uss_fetch(), in file order
+		if (!uss_load(f, mb->offset, mb->addr, chunksize)) {
 			printf("ERROR: Read error (Chunk '%s', %lu bytes).\n", mb->chunk, chunksize);
 			st->errors++;
-		}		
+		}
 	} else {
 		printf("ERROR: Out of memory (Chunk '%s', %lu bytes).\n", mb->chunk, chunksize);
 		st->errors++;
 	}
-	fseek(f, oldoffset, SEEK_SET);
 }
 
-static int read_chunk_head(FILE *f, UBYTE *cnamep, ULONG *sizep, ULONG *flagsp)
+static int read_chunk_head(struct ussfile *f, UBYTE *cnamep, ULONG *sizep, ULONG *flagsp)
 {
 	ULONG size = 0, flags = 0;
 	UBYTE cname[5];
@@ -1419,18 +1440,18 @@ static int read_chunk_head(FILE *f, UBYTE *cnamep, ULONG *sizep, ULONG *flagsp)
 	*flagsp = 0;
 	*sizep = 0;
 	cnamep[0] = 0;
-	if (fread(cname, 1, 4, f) != 4) {
+	if (uss_read(f, cname, 4) != 4) {
 		return 0;
 	}
 	cname[4] = 0;
 	strcpy(cnamep, cname);
 
-	if (fread(&size, 1, 4, f) != 4) {
+	if (uss_read(f, &size, 4) != 4) {
 		cnamep[0] = 0;
 		return 0;
 	}
 
-	if (fread(&flags, 1, 4, f) == 0) {
+	if (uss_read(f, &flags, 4) == 0) {
 		return 1;
 	}
 
@@ -1448,7 +1469,7 @@ static int read_chunk_head(FILE *f, UBYTE *cnamep, ULONG *sizep, ULONG *flagsp)
 	return 1;
 }
 
-static UBYTE *load_chunk(FILE *f, UBYTE *cname, ULONG size, struct uaestate *st)
+static UBYTE *load_chunk(struct ussfile *f, UBYTE *cname, ULONG size, struct uaestate *st)
 {
 	UBYTE *b = NULL;
 	int acate = 0;
@@ -1464,17 +1485,17 @@ static UBYTE *load_chunk(FILE *f, UBYTE *cname, ULONG size, struct uaestate *st)
 		return NULL;
 	}
 	
-	if (fread(b, 1, size, f) != size) {
+	if (uss_read(f, b, size) != size) {
 		printf("ERROR: Read error  (Chunk '%s', %lu bytes).\n", cname, size);
 		return NULL;
 	}
 	
-	fseek(f, 4 - (size & 3), SEEK_CUR);
+	uss_seek(f, 4 - (size & 3), SEEK_CUR);
 		
 	return b;
 }
 
-static UBYTE *read_chunk(FILE *f, UBYTE *cname, ULONG *sizep, ULONG *flagsp, struct uaestate *st)
+static UBYTE *read_chunk(struct ussfile *f, UBYTE *cname, ULONG *sizep, ULONG *flagsp, struct uaestate *st)
 {
 	ULONG size, orgsize, flags;
 
@@ -1488,44 +1509,30 @@ static UBYTE *read_chunk(FILE *f, UBYTE *cname, ULONG *sizep, ULONG *flagsp, str
 
 	ULONG maxsize = 0x7fffffff;
 
-	for (int i = 0; unsupportedchunknames[i]; i++) {
-		if (!strcmp(cname, unsupportedchunknames[i])) {
-			printf("ERROR: Unsupported chunk '%s', %lu bytes, flags %08x.\n", cname, size, flags);
-			st->errors++;
-			return NULL;
-		}
+	const struct chunktype *ct = find_chunktype(cname);
+	if (ct && ct->kind == CHUNKTYPE_UNSUPPORTED) {
+		printf("ERROR: Unsupported chunk '%s', %lu bytes, flags %08x.\n", cname, size, flags);
+		st->errors++;
+		return NULL;
 	}
 
-	int found = 0;
-	for (int i = 0; chunknames[i]; i++) {
-		if (!strcmp(cname, chunknames[i])) {
-			found = 1;
-			if (st->debug)
-				printf("Reading chunk '%s', %lu bytes, flags %08x.\n", cname, size, flags);
-			break;
-		}
-	}
-	if (!found) {
-		// read only header if memory chunk
-		for (int i = 0; memchunknames[i]; i++) {
-			if (!strcmp(cname, memchunknames[i])) {
-				found = 1;
-				maxsize = 16;
-				if (st->debug)
-					printf("Checking memory chunk '%s', %lu bytes, flags %08x.\n", cname, size, flags);
-				break;
-			}	
-		}
-	}
-	
-	if (!found) {
+	if (!ct) {
 		//printf("Skipped chunk '%s', %lu bytes, flags %08x\n", cname, size, flags);
-		fseek(f, size, SEEK_CUR);
+		uss_seek(f, size, SEEK_CUR);
 		if (size)
-			fseek(f, 4 - (size & 3), SEEK_CUR);
+			uss_seek(f, 4 - (size & 3), SEEK_CUR);
 		return NULL;
 	}
 
+	if (ct->maxsize)
+		maxsize = ct->maxsize;
+	if (ct->kind == CHUNKTYPE_MEMORY) {
+		if (st->debug)
+			printf("Checking memory chunk '%s', %lu bytes, flags %08x.\n", cname, size, flags);
+	} else if (st->debug) {
+		printf("Reading chunk '%s', %lu bytes, flags %08x.\n", cname, size, flags);
+	}
+
 	*sizep = size;
 	if (size > maxsize)
 		size = maxsize;	
@@ -1534,18 +1541,90 @@ static UBYTE *read_chunk(FILE *f, UBYTE *cname, ULONG *sizep, ULONG *flagsp, str
 		printf("ERROR: Not enough memory (Chunk '%s', %lu bytes).\n", cname, size);
 		return NULL;
 	}
-	if (fread(chunk, 1, size, f) != size) {
+	if (uss_read(f, chunk, size) != size) {
 		printf("ERROR: Read error (Chunk '%s', %lu bytes).\n", cname, size);
 		free(chunk);
 		return NULL;
 	}
 	if (orgsize > size) {
-		fseek(f, orgsize - size, SEEK_CUR);
+		uss_seek(f, orgsize - size, SEEK_CUR);
 	}
-	fseek(f, 4 - (orgsize & 3), SEEK_CUR);
+	uss_seek(f, 4 - (orgsize & 3), SEEK_CUR);
 	return chunk;	
 }
 
+// Delta state file (usspack -d): ASF, BASE (base state file name, looked up
+// from the delta file's directory unless it has a volume), other chunks
+// replace base state file chunks. Returns 1 if delta, -1 if invalid.
+static int delta_base(struct ussfile *f, const char *path, UBYTE *name, ULONG namesize)
+{
+	ULONG size, flags;
+	UBYTE cname[5];
+	const char *file = path;
+	int delta = 0;
+
+	if (read_chunk_head(f, cname, &size, &flags) && !strcmp(cname, "ASF ")) {
+		uss_seek(f, size + 4 - (size & 3), SEEK_CUR);
+		if (read_chunk_head(f, cname, &size, &flags) && !strcmp(cname, "BASE")) {
+			for (const char *p = path; *p; p++) {
+				if (*p == '/' || *p == ':')
+					file = p + 1;
+			}
+			ULONG dirlen = file - path;
+			delta = -1;
+			if (size && dirlen + size < namesize) {
+				memcpy(name, path, dirlen);
+				if (uss_read(f, name + dirlen, size) == size) {
+					name[dirlen + size] = 0;
+					if (strchr(name + dirlen, ':'))
+						memmove(name, name + dirlen, size + 1);
+					delta = 1;
+				}
+			}
+			if (delta < 0)
+				printf("ERROR: Invalid delta state file base name.\n");
+		}
+	}
+	uss_seek(f, 0, SEEK_SET);
+	return delta;
+}
+
+// uncompressed size of a memory bank
+static ULONG membank_size(struct MemoryBank *mb)
+{
+	if (mb->flags & (CHUNK_COMPRESSED | CHUNK_SPARSE))
+		return getlong(mb->addr + 12, 0);
+	return mb->size;
+}
+
+// delta memory chunk, patched over its base bank after decompression
+static void load_delta(struct ussfile *f, UBYTE *cname, ULONG size, int index, struct uaestate *st)
+{
+	struct MemoryBank *mb = &st->membanks[index];
+	UBYTE *p = load_chunk(f, cname, size, st);
+	if (!p) {
+		st->errors++;
+		return;
+	}
+	// base bank size header: its read may still be in flight
+	if (mb->addr && (mb->flags & (CHUNK_COMPRESSED | CHUNK_SPARSE)) && !uss_wait(st->file, mb->addr)) {
+		printf("ERROR: Read error (Chunk '%s').\n", mb->chunk);
+		st->errors++;
+		return;
+	}
+	ULONG pagesize = getlong(p, 4);
+	ULONG pages = pagesize ? getlong(p, 0) / pagesize : 0;
+	if (!mb->addr || size < 12 || !pages || getlong(p, 0) != membank_size(mb) || getlong(p, 0) % pagesize ||
+		size != 12 + ((pages + 31) / 32) * 4 + getlong(p, 8) * pagesize) {
+		printf("ERROR: Delta chunk '%s' does not match base state file.\n", cname);
+		st->errors++;
+		return;
+	}
+	mb->delta = p;
+	if (st->debug)
+		printf("Memory '%s' delta, %lu of %lu pages changed.\n", cname, getlong(p, 8), pages);
+}
+
 static void enable_extra_ram(struct uaestate *st)
 {
 		struct extraram *er = &st->eram[0];
@@ -1637,10 +1716,32 @@ static void find_extra_ram(struct uaestate *st)
 	}
 }
 
+// Compressed data is loaded so that it ends this far from the start of its
+// own target bank. Remaining input can't become shorter than remaining output
+// minus the margin: decompression never overwrites data it has not read yet.
+static ULONG inplace_size(UBYTE *chunk, ULONG chunksize, ULONG flags)
+{
+	// page map is still needed after decompression
+	if (flags & CHUNK_SPARSE)
+		return 0;
+	// block index is read while blocks are decompressed
+	if (flags & CHUNK_BLOCKS)
+		return 0;
+	// chunk header and data, copied 12 bytes down
+	if (!(flags & CHUNK_COMPRESSED))
+		return chunksize + 12;
+	ULONG size = getlong(chunk, 0);
+	// literal run length bytes (1 per 255 literals), last sequence, checksum
+	if (flags & CHUNK_LZ4)
+		return size + (chunksize >> 8) + 32 + 4;
+	// stored block headers, one block coded worse than average, zlib header and checksum
+	return size + (size >> 12) + 32768 + 18;
+}
+
 static void check_ram(UBYTE *ramname, UBYTE *cname, UBYTE *chunk, WORD index, ULONG addr, ULONG offset, ULONG chunksize, ULONG flags, BOOL earlycheck, struct uaestate *st)
 {
-	ULONG size;
-	if (flags & 1) // compressed
+	ULONG size, remapaddr = 0;
+	if (flags & (CHUNK_COMPRESSED | CHUNK_SPARSE)) // compressed or sparse
 		size = getlong(chunk, 0);
 	else
 		size = chunksize;
@@ -1667,7 +1768,8 @@ static void check_ram(UBYTE *ramname, UBYTE *cname, UBYTE *chunk, WORD index, UL
 		if (earlycheck)
 			return;
 		// use MMU to create this address space if available
-		if (mmu_remap(addr, size, FALSE, 0, st)) {
+		remapaddr = mmu_remap(addr, size, FALSE, 0, st);
+		if (remapaddr) {
 			msize = size;
 			mstart = addr;
 			mh = NULL;
@@ -1685,12 +1787,17 @@ static void check_ram(UBYTE *ramname, UBYTE *cname, UBYTE *chunk, WORD index, UL
 	mb->targetaddr = (UBYTE*)addr;
 	mb->targetsize = msize;
 	mb->flags = flags;
+	mb->inplacesize = 0;
+	mb->remapaddr = (UBYTE*)remapaddr;
 	strcpy(mb->chunk, cname);
 	if (st->debug)
 		printf("- Detected memory at %08x, total size %luk. Offset %lu.\n", mstart, msize >> 10, offset);
 	if (found > 0) {
 		if (st->debug)
 			printf("- Memory is usable (%luk required, %luk unused).\n", size >> 10, (msize - size) >> 10);
+		// real RAM, not MMU remapped
+		if (mh)
+			mb->inplacesize = inplace_size(chunk, chunksize, flags);
 		ULONG extrasize = msize - size;
 		if (extrasize >= 524288) {
 			UBYTE *base = (UBYTE*)(mstart + size);
@@ -1768,8 +1875,13 @@ static void floppy_info(int num, UBYTE *p)
 		printf("<empty>\n");
 }
 
-static void fpu_process(UBYTE *fpu, struct uaestate *st)
+static void fpu_process(UBYTE *fpu, ULONG flags, struct uaestate *st)
 {
+	// native state file: already converted
+	if (flags & CHUNK_FPU12) {
+		*((ULONG**)st->fpu_chunk) = (ULONG*)(st->fpu_chunk + 8);
+		return;
+	}
 	ULONG *b = (ULONG*)tempmem_allocate(12 * 8 + 3 * 4, FALSE, st);
 	if (!b) {
 		st->fpu_chunk = NULL;
@@ -1839,17 +1951,203 @@ static void check_rom(UBYTE *p, struct uaestate *st)
 	}
 }
 
-static int parse_pass_2(FILE *f, struct uaestate *st)
+static void check_cpu(UBYTE *p, struct uaestate *st)
+{
+	ULONG smodel = 68000;
+	for (int i = 0; i < 4; i++) {
+		if (SysBase->AttnFlags & (1 << i))
+			smodel += 10;
+	}
+	if (SysBase->AttnFlags & 0x80)
+		smodel = 68060;
+	ULONG model = getlong(p, 0);
+	printf("CPU: %lu.\n", model);
+	if (smodel != model) {
+		printf("- WARNING: %lu CPU statefile but system has %lu CPU.\n", model, smodel);
+	}
+}
+
+static void check_fpu(UBYTE *p, struct uaestate *st)
+{
+	ULONG model = getlong(p, 0);
+	ULONG smodel = 0;
+	if (SysBase->AttnFlags & AFF_68882)
+		smodel = 68882;
+	else if (SysBase->AttnFlags & AFF_68881)
+		smodel = 68881;
+	if (SysBase->AttnFlags & 0x80)
+		smodel = 68060;
+	else if (SysBase->AttnFlags & AFF_68040)
+		smodel = 68040;
+	if (model && !smodel) {
+		printf("- WARNING: FPU statefile (%lu) but system has no FPU.\n", model);
+	} else if (model != smodel) {
+		printf("- WARNING: %lu FPU statefile but system has %lu FPU.\n", model, smodel);
+	}
+}
+
+static void check_chipset(UBYTE *p, struct uaestate *st)
+{
+	UWORD vposr = getword(p, 4 + 4); // VPOSR
+	volatile struct Custom *c = (volatile struct Custom*)0xdff000;
+	UWORD svposr = c->vposr;
+	int aga = (vposr & 0x0f00) == 0x0300;
+	int ecs = (vposr & 0x2000) == 0x2000;
+	int ntsc = (vposr & 0x1000) == 0x1000;
+	int saga = (svposr & 0x0f00) == 0x0300;
+	int secs = (svposr & 0x2000) == 0x2000;
+	int sntsc = (svposr & 0x1000) == 0x1000;
+	printf("Chipset: %s %s (0x%04X).\n", aga ? "AGA" : (ecs ? "ECS" : "OCS"), ntsc ? "NTSC" : "PAL", vposr);
+	if (aga && !saga) {
+		printf("- WARNING: AGA statefile but system is OCS/ECS.\n");
+	}
+	if (saga && !aga) {
+		printf("- WARNING: OCS/ECS statefile but system is AGA.\n");
+	}
+	if (!sntsc && !secs && ntsc) {
+		printf("- WARNING: NTSC statefile but system is OCS PAL.\n");
+	}
+	if (sntsc && !secs && !ntsc) {
+		printf("- WARNING: PAL statefile but system is OCS NTSC.\n");
+	}
+	st->agastate = aga;
+}
+
+static void check_cd32(UBYTE *p, struct uaestate *st)
+{
+	if (st->hwtype != HWTYPE_CD32) {
+		printf("- WARNING: CD32 statefile but system is not CD32.\n");
+	}
+}
+
+static void check_cdtv(UBYTE *p, struct uaestate *st)
 {
+	if (st->hwtype != HWTYPE_CDTV) {
+		printf("- WARNING: CDTV statefile but system is not CDTV.\n");
+	}
+}
+
+static void load_fpu(UBYTE *p, ULONG flags, int index, struct uaestate *st)
+{
+	fpu_process(p, flags, st);
+}
+
+static void load_floppy(UBYTE *p, ULONG flags, int index, struct uaestate *st)
+{
+	floppy_info(index, p);
+}
+
+static void load_dmac(UBYTE *p, ULONG flags, int index, struct uaestate *st)
+{
+	if (!st->cdtv_chunk) {
+		printf("ERROR: Incompatible statefile: DMAC chunk without CDTV chunk.\n");
+		st->errors++;
+		st->cdtv_dmac_chunk = NULL;
+	}
+}
+
+#define STATE_CHUNK(a, b, c, d, slot) { CHUNK_ID(a, b, c, d), CHUNKTYPE_STATE, 0, 0, offsetof(struct uaestate, slot) }
+
+// All chunks ussload uses, other chunks are skipped (see struct chunktype).
+static const struct chunktype chunktypes[] =
+{
+	{ CHUNK_ID('A', 'S', 'F', ' '), CHUNKTYPE_STATE },
+	{ CHUNK_ID('C', 'P', 'U', ' '), CHUNKTYPE_STATE, 0, 0, offsetof(struct uaestate, cpu_chunk), check_cpu },
+	{ CHUNK_ID('F', 'P', 'U', ' '), CHUNKTYPE_STATE, 0, 0, offsetof(struct uaestate, fpu_chunk), check_fpu, load_fpu },
+	{ CHUNK_ID('C', 'H', 'I', 'P'), CHUNKTYPE_STATE, 0, 0, offsetof(struct uaestate, custom_chunk), check_chipset },
+	STATE_CHUNK('A', 'G', 'A', 'C', aga_colors_chunk),
+	STATE_CHUNK('C', 'I', 'A', 'A', ciaa_chunk),
+	STATE_CHUNK('C', 'I', 'A', 'B', ciab_chunk),
+	{ CHUNK_ID('R', 'O', 'M', ' '), CHUNKTYPE_STATE, 0, 0, 0, check_rom },
+	{ CHUNK_ID('D', 'S', 'K', '0'), CHUNKTYPE_STATE, 0, 0, offsetof(struct uaestate, floppy_chunk[0]), NULL, load_floppy },
+	{ CHUNK_ID('D', 'S', 'K', '1'), CHUNKTYPE_STATE, 0, 1, offsetof(struct uaestate, floppy_chunk[1]), NULL, load_floppy },
+	{ CHUNK_ID('D', 'S', 'K', '2'), CHUNKTYPE_STATE, 0, 2, offsetof(struct uaestate, floppy_chunk[2]), NULL, load_floppy },
+	{ CHUNK_ID('D', 'S', 'K', '3'), CHUNKTYPE_STATE, 0, 3, offsetof(struct uaestate, floppy_chunk[3]), NULL, load_floppy },
+	STATE_CHUNK('A', 'U', 'D', '0', audio_chunk[0]),
+	STATE_CHUNK('A', 'U', 'D', '1', audio_chunk[1]),
+	STATE_CHUNK('A', 'U', 'D', '2', audio_chunk[2]),
+	STATE_CHUNK('A', 'U', 'D', '3', audio_chunk[3]),
+	STATE_CHUNK('S', 'P', 'R', '0', sprite_chunk[0]),
+	STATE_CHUNK('S', 'P', 'R', '1', sprite_chunk[1]),
+	STATE_CHUNK('S', 'P', 'R', '2', sprite_chunk[2]),
+	STATE_CHUNK('S', 'P', 'R', '3', sprite_chunk[3]),
+	STATE_CHUNK('S', 'P', 'R', '4', sprite_chunk[4]),
+	STATE_CHUNK('S', 'P', 'R', '5', sprite_chunk[5]),
+	STATE_CHUNK('S', 'P', 'R', '6', sprite_chunk[6]),
+	STATE_CHUNK('S', 'P', 'R', '7', sprite_chunk[7]),
+	{ CHUNK_ID('C', 'D', 'T', 'V'), CHUNKTYPE_STATE, 0, 0, offsetof(struct uaestate, cdtv_chunk), check_cdtv },
+	{ CHUNK_ID('D', 'M', 'A', 'C'), CHUNKTYPE_STATE, 0, 0, offsetof(struct uaestate, cdtv_dmac_chunk), NULL, load_dmac },
+	{ CHUNK_ID('C', 'D', '3', '2'), CHUNKTYPE_STATE, 0, 0, offsetof(struct uaestate, cd32_chunk), check_cd32 },
+	{ CHUNK_ID('B', 'A', 'S', 'E'), CHUNKTYPE_STATE }, // delta base name, see delta_base()
+	{ CHUNK_ID('E', 'N', 'D', ' '), CHUNKTYPE_STATE },
+	{ CHUNK_ID('C', 'R', 'A', 'M'), CHUNKTYPE_MEMORY, CHUNK_HEADSIZE, MB_CHIP },
+	{ CHUNK_ID('B', 'R', 'A', 'M'), CHUNKTYPE_MEMORY, CHUNK_HEADSIZE, MB_SLOW },
+	{ CHUNK_ID('F', 'R', 'A', 'M'), CHUNKTYPE_MEMORY, CHUNK_HEADSIZE, MB_FAST },
+	{ CHUNK_ID('F', 'R', 'A', '2'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('F', 'R', 'A', '3'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('F', 'R', 'A', '4'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('Z', 'R', 'A', '2'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('Z', 'R', 'A', '3'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('Z', 'R', 'A', '4'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('Z', 'C', 'R', 'M'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('P', 'R', 'A', 'M'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('A', '3', 'K', '1'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('A', '3', 'K', '2'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('B', 'O', 'R', 'O'), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('P', '9', '6', ' '), CHUNKTYPE_UNSUPPORTED },
+	{ CHUNK_ID('F', 'S', 'Y', 'C'), CHUNKTYPE_UNSUPPORTED },
+};
+
+// memory bank name and address, by bank
+static const char *const memnames[] = { "Chip", "Slow", "Fast" };
+static const ULONG memaddrs[] = { 0x000000, 0xc00000, 0x200000 };
+
+// chunk type, NULL if not used by ussload
+const struct chunktype *find_chunktype(const UBYTE *cname)
+{
+	ULONG id = getlong((UBYTE*)cname, 0);
+	for (int i = 0; i < sizeof chunktypes / sizeof chunktypes[0]; i++) {
+		if (chunktypes[i].id == id)
+			return &chunktypes[i];
+	}
+	return NULL;
+}
+
+static int parse_pass_2(struct ussfile *f, struct ussfile *delta, struct uaestate *st)
+{
+	// in place chunks first, before other chunks are put in free target space
+	for (int i = 0; i < MEMORY_REGIONS; i++) {
+		struct MemoryBank *mb = &st->membanks[i];
+		if (mb->size) {
+			mb->addr = tempmem_allocate_inplace(mb->size + 12, i, st);
+		}
+	}
 	for (int i = 0; i < MEMORY_REGIONS; i++) {
 		struct MemoryBank *mb = &st->membanks[i];
 		if (mb->size) {
 			load_memory(f, i, st);
 		}
 	}
+	if (!uss_fetch(f)) {
+		printf("ERROR: Read error (memory chunks).\n");
+		st->errors++;
+	}
+	for (int i = 0; i < MEMORY_REGIONS; i++) {
+		struct MemoryBank *mb = &st->membanks[i];
+		if (!mb->addr || !(mb->flags & CHUNK_BLOCKS) || !st->debug)
+			continue;
+		// block index: read may still be in flight
+		if (!uss_wait(f, mb->addr))
+			continue;
+		blocks_info(mb->chunk, mb->addr + 12);
+	}
 	if (st->romver) {
-		load_rom(st);
+		load_rom(f, st);
 	}
+
+	// delta state file: all other chunks come from the delta
+	if (delta)
+		f = delta;
 	
 	for (;;) {
 		ULONG size, flags;
@@ -1862,82 +2160,32 @@ static int parse_pass_2(FILE *f, struct uaestate *st)
 		if (!strcmp(cname, "END "))
 			break;
 
-		if (!strcmp(cname, "CPU ")) {
-			st->cpu_chunk = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "FPU ")) {
-			st->fpu_chunk = load_chunk(f, cname, size, st);
-			fpu_process(st->fpu_chunk, st);		
-		} else if (!strcmp(cname, "CHIP")) {
-			st->custom_chunk = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "AGAC")) {
-			st->aga_colors_chunk = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "CIAA")) {
-			st->ciaa_chunk = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "CIAB")) {
-			st->ciab_chunk = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "DSK0")) {
-			st->floppy_chunk[0] = load_chunk(f, cname, size, st);
-			floppy_info(0, st->floppy_chunk[0]);
-		} else if (!strcmp(cname, "DSK1")) {
-			st->floppy_chunk[1] = load_chunk(f, cname, size, st);
-			floppy_info(1, st->floppy_chunk[1]);
-		} else if (!strcmp(cname, "DSK2")) {
-			st->floppy_chunk[2] = load_chunk(f, cname, size, st);
-			floppy_info(2, st->floppy_chunk[2]);
-		} else if (!strcmp(cname, "DSK3")) {
-			st->floppy_chunk[3] = load_chunk(f, cname, size, st);
-			floppy_info(3, st->floppy_chunk[3]);
-		} else if (!strcmp(cname, "AUD0")) {
-			st->audio_chunk[0] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "AUD1")) {
-			st->audio_chunk[1] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "AUD2")) {
-			st->audio_chunk[2] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "AUD3")) {
-			st->audio_chunk[3] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "SPR0")) {
-			st->sprite_chunk[0] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "SPR1")) {
-			st->sprite_chunk[1] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "SPR2")) {
-			st->sprite_chunk[2] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "SPR3")) {
-			st->sprite_chunk[3] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "SPR4")) {
-			st->sprite_chunk[4] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "SPR5")) {
-			st->sprite_chunk[5] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "SPR6")) {
-			st->sprite_chunk[6] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "SPR7")) {
-			st->sprite_chunk[7] = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "CD32")) {
-			st->cd32_chunk = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "CDTV")) {
-			st->cdtv_chunk = load_chunk(f, cname, size, st);
-		} else if (!strcmp(cname, "DMAC")) {
-			if (!st->cdtv_chunk) {
-				printf("ERROR: Incompatible statefile: DMAC chunk without CDTV chunk.\n");
-				st->errors++;
-			} else {
-				st->cdtv_dmac_chunk = load_chunk(f, cname, size, st);
-			}
+		const struct chunktype *ct = find_chunktype(cname);
+		if (ct && ct->slot) {
+			UBYTE **slot = (UBYTE**)((UBYTE*)st + ct->slot);
+			*slot = load_chunk(f, cname, size, st);
+			if (ct->load)
+				ct->load(*slot, flags, ct->index, st);
+		} else if (ct && ct->kind == CHUNKTYPE_MEMORY && (flags & CHUNK_DELTA) && delta) {
+			load_delta(f, cname, size, ct->index, st);
 		} else {
-			fseek(f, size, SEEK_CUR);
-			fseek(f, 4 - (size & 3), SEEK_CUR);
+			uss_seek(f, size, SEEK_CUR);
+			uss_seek(f, 4 - (size & 3), SEEK_CUR);
 		}
 	}
+	if (delta)
+		uss_fetch(delta);
 
 	return st->errors;
 }
 
-static int parse_pass_1(FILE *f, BOOL earlycheck, struct uaestate *st)
+static int parse_pass_1(struct ussfile *f, BOOL earlycheck, struct uaestate *st)
 {
 	int first = 1;
 	UBYTE *b = NULL;
 
 	for (;;) {
-		ULONG offset = ftell(f);
+		ULONG offset = uss_tell(f);
 		ULONG size, flags;
 		UBYTE cname[5];
 		b = read_chunk(f, cname, &size, &flags, st);
@@ -1958,80 +2206,11 @@ static int parse_pass_1(FILE *f, BOOL earlycheck, struct uaestate *st)
 			continue;
 		}
 
-		if (!earlycheck) {
-			if (!strcmp(cname, "CPU ")) {
-				ULONG smodel = 68000;
-				for (int i = 0; i < 4; i++) {
-					if (SysBase->AttnFlags & (1 << i))
-						smodel += 10;
-				}
-				if (SysBase->AttnFlags & 0x80)
-					smodel = 68060;
-				ULONG model = getlong(b, 0);
-				printf("CPU: %lu.\n", model);
-				if (smodel != model) {
-					printf("- WARNING: %lu CPU statefile but system has %lu CPU.\n", model, smodel);
-				}
-			} else if(!strcmp(cname, "FPU ")) {
-				ULONG model = getlong(b, 0);
-				ULONG smodel = 0;
-				if (SysBase->AttnFlags & AFF_68882)
-					smodel = 68882;
-				else if (SysBase->AttnFlags & AFF_68881)
-					smodel = 68881;
-				if (SysBase->AttnFlags & 0x80)
-					smodel = 68060;
-				else if (SysBase->AttnFlags & AFF_68040)
-					smodel = 68040;
-				if (model && !smodel) {
-					printf("- WARNING: FPU statefile (%lu) but system has no FPU.\n", model);
-				} else if (model != smodel) {
-					printf("- WARNING: %lu FPU statefile but system has %lu FPU.\n", model, smodel);
-				}
-			} else if (!strcmp(cname, "CHIP")) {
-				UWORD vposr = getword(b, 4 + 4); // VPOSR
-				volatile struct Custom *c = (volatile struct Custom*)0xdff000;
-				UWORD svposr = c->vposr;
-				int aga = (vposr & 0x0f00) == 0x0300;
-				int ecs = (vposr & 0x2000) == 0x2000;
-				int ntsc = (vposr & 0x1000) == 0x1000;
-				int saga = (svposr & 0x0f00) == 0x0300;
-				int secs = (svposr & 0x2000) == 0x2000;
-				int sntsc = (svposr & 0x1000) == 0x1000;
-				printf("Chipset: %s %s (0x%04X).\n", aga ? "AGA" : (ecs ? "ECS" : "OCS"), ntsc ? "NTSC" : "PAL", vposr);
-				if (aga && !saga) {
-					printf("- WARNING: AGA statefile but system is OCS/ECS.\n");
-				}
-				if (saga && !aga) {
-					printf("- WARNING: OCS/ECS statefile but system is AGA.\n");
-				}
-				if (!sntsc && !secs && ntsc) {
-					printf("- WARNING: NTSC statefile but system is OCS PAL.\n");
-				}
-				if (sntsc && !secs && !ntsc) {
-					printf("- WARNING: PAL statefile but system is OCS NTSC.\n");
-				}
-				st->agastate = aga;
-			} else if (!strcmp(cname, "ROM ")) {
-				check_rom(b, st);
-			} else if (!strcmp(cname, "CD32")) {
-				if (st->hwtype != HWTYPE_CD32) {
-					printf("- WARNING: CD32 statefile but system is not CD32.\n");
-				}
-			} else if (!strcmp(cname, "CDTV")) {
-				if (st->hwtype != HWTYPE_CDTV) {
-					printf("- WARNING: CDTV statefile but system is not CDTV.\n");
-				}
-			}
-		}
-		
-		if (!strcmp(cname, "CRAM")) {
-			check_ram("Chip", cname, b, MB_CHIP, 0x000000, offset, size, flags, earlycheck, st);
-		} else if (!strcmp(cname, "BRAM")) {
-			check_ram("Slow", cname, b, MB_SLOW, 0xc00000, offset, size, flags, earlycheck, st);
-		} else if (!strcmp(cname, "FRAM")) {
-			check_ram("Fast", cname, b, MB_FAST, 0x200000, offset, size, flags, earlycheck, st);
-		}
+		const struct chunktype *ct = find_chunktype(cname);
+		if (!earlycheck && ct->check)
+			ct->check(b, st);
+		if (ct->kind == CHUNKTYPE_MEMORY)
+			check_ram(memnames[ct->index], cname, b, ct->index, memaddrs[ct->index], offset, size, flags, earlycheck, st);
 
 		free(b);
 		b = NULL;
@@ -2066,24 +2245,828 @@ static int parse_pass_1(FILE *f, BOOL earlycheck, struct uaestate *st)
 }
 
 extern void runit(void*);
-extern void callinflate(UBYTE*, UBYTE*);
+extern void callinflate(UBYTE*, UBYTE*, ULONG, UBYTE*, struct inflatecontext*);
+extern void callinflatecode(UBYTE*, UBYTE*, void*, UBYTE*, struct inflatecontext*);
+extern void unlz4(UBYTE*, UBYTE*, UBYTE*);
+extern void fillmem(ULONG*, ULONG, ULONG);
+extern ULONG adler32(ULONG, UBYTE*, ULONG);
+extern UBYTE inflate_hot[], inflate040_hot[];
+extern UBYTE inflate020[], inflate020_start[], inflate020_hot[], inflate020_end[];
 extern void flushcache(void);
+extern void flushmmu040(void);
+extern void flushmmu030(void);
+extern void lazyfault(void);
 extern void detect060(void);
 extern void detect030040(void);
 extern UWORD detectmmu(void);
 
-static void handlerambank(struct MemoryBank *mb, struct uaestate *st)
+// sparse memory chunk header and page map size
+static ULONG sparse_headersize(UBYTE *p)
+{
+	ULONG size = getlong(p, 0);
+	ULONG pagesize = getlong(p, 4);
+	ULONG pages = (size + pagesize - 1) / pagesize;
+	return 12 + ((pages + 31) / 32) * 4 + (pages - getlong(p, 8)) * 4;
+}
+
+// memory chunk data after the chunk header and sparse page map
+static UBYTE *membank_data(struct MemoryBank *mb, ULONG *sizep)
+{
+	UBYTE *p = mb->addr + 12; /* skip chunk header */
+	ULONG size = mb->size;
+	if (mb->flags & CHUNK_SPARSE) {
+		ULONG skip = sparse_headersize(p);
+		p += skip;
+		size -= skip;
+	}
+	*sizep = size;
+	return p;
+}
+
+// Move packed data pages from src to their place in dst and fill all other
+// pages. Last page first, src can be dst: data pages only move upwards.
+static void expand_sparse(UBYTE *dst, UBYTE *src, UBYTE *p)
+{
+	ULONG size = getlong(p, 0);
+	ULONG pagesize = getlong(p, 4);
+	ULONG datapages = getlong(p, 8);
+	ULONG pages = (size + pagesize - 1) / pagesize;
+	UBYTE *bitmap = p + 12;
+	ULONG *fill = (ULONG*)(bitmap + ((pages + 31) / 32) * 4) + (pages - datapages);
+	UBYTE *s = src + datapages * pagesize;
+	ULONG offset = (pages - 1) * pagesize;
+	ULONG len = size - offset;
+
+	for (LONG i = pages - 1; i >= 0; i--) {
+		UBYTE *d = dst + offset;
+		if (bitmap[i >> 3] & (0x80 >> (i & 7))) {
+			s -= pagesize;
+			if (s != d) {
+				ULONG *sl = (ULONG*)s;
+				ULONG *dl = (ULONG*)d;
+				for (ULONG j = 0; j < len / 4; j++) {
+					*dl++ = *sl++;
+				}
+			}
+		} else {
+			fillmem((ULONG*)d, len / 4, *--fill);
+		}
+		offset -= pagesize;
+		len = pagesize;
+	}
+}
+
+static void copylongs(ULONG *d, ULONG *s, ULONG longs)
+{
+	for (ULONG i = 0; i < longs; i++) {
+		*d++ = *s++;
+	}
+}
+
+// delta state file: copy changed pages over the base bank
+static void patch_bank(UBYTE *dst, UBYTE *p)
+{
+	ULONG pagesize = getlong(p, 4);
+	ULONG pages = getlong(p, 0) / pagesize;
+	UBYTE *bitmap = p + 12;
+	ULONG *s = (ULONG*)(bitmap + ((pages + 31) / 32) * 4);
+
+	for (ULONG i = 0; i < pages; i++) {
+		if (bitmap[i >> 3] & (0x80 >> (i & 7))) {
+			copylongs((ULONG*)(dst + i * pagesize), s, pagesize / 4);
+			s += pagesize / 4;
+		}
+	}
+}
+
+// CHUNK_BLOCKS: block data and its size, decompressed size in *lenp
+static UBYTE *block_data(UBYTE *p, ULONG i, ULONG *sizep, ULONG *lenp)
 {
-	UBYTE *sa = mb->addr + 12; /* skip chunk header */
-	if (mb->flags & 1) {
+	ULONG size = getlong(p, 0);
+	ULONG blocksize = getlong(p, 4);
+	ULONG start = getlong(p, 12 + i * 4);
+	*sizep = getlong(p, 12 + i * 4 + 4) - start;
+	*lenp = size - i * blocksize < blocksize ? size - i * blocksize : blocksize;
+	return p + start;
+}
+
+// constant block (4 bytes) is filled, others are decompressed on their own
+static void decode_block(UBYTE *d, ULONG len, UBYTE *s, ULONG size, ULONG flags, UWORD cpu, void *code, UBYTE *stack, struct inflatecontext *ic)
+{
+	if (size == 4) {
+		fillmem((ULONG*)d, len / 4, getlong(s, 0));
+	} else if (flags & CHUNK_LZ4) {
+		unlz4(d, s, d + len);
+	} else {
+		// new stream: window starts empty
+		ic->dst = d;
+		ic->flushed = ic->buf;
+		ic->burst = BURST_RAM(ic->buf ? ic->buf : d);
+		// skip zlib header
+		if (code)
+			callinflatecode(d, s + 2, code, stack, ic);
+		else
+			callinflate(d, s + 2, cpu, stack, ic);
+	}
+}
+
+// all blocks in order, blocks staged before take over are only copied
+static void decode_blocks(struct MemoryBank *mb, UBYTE *dst, UWORD cpu, void *code, UBYTE *stack, struct inflatecontext *ic)
+{
+	UBYTE *p = mb->addr + 12;
+	ULONG blocks = getlong(p, 8);
+	ULONG blocksize = getlong(p, 4);
+
+	for (ULONG i = 0; i < blocks; i++) {
+		ULONG size, len;
+		UBYTE *s = block_data(p, i, &size, &len);
+		UBYTE *d = dst + i * blocksize;
+		if (mb->blockstage && mb->blockstage[i])
+			copylongs((ULONG*)d, (ULONG*)mb->blockstage[i], len / 4);
+		else
+			decode_block(d, len, s, size, mb->flags, cpu, code, stack, ic);
+	}
+}
+
+static void decompress_bank(struct MemoryBank *mb, UBYTE *dst, struct inflatecontext *ic, struct uaestate *st)
+{
+	ULONG size;
+	UBYTE *sa = membank_data(mb, &size);
+	if (mb->flags & CHUNK_BLOCKS) {
+		decode_blocks(mb, dst, st->attnflags, NULL, st->inflatework + INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE, ic);
+	} else if (mb->flags & CHUNK_LZ4) {
+		// skip decompressed size
+		unlz4(dst, sa + 4, dst + getlong(sa, 0));
+	} else if (mb->flags & 1) {
 		// skip decompressed size and zlib header
-		callinflate(mb->targetaddr, sa + 4 + 2);
+		ic->burst = BURST_RAM(ic->buf ? ic->buf : dst);
+		callinflate(dst, sa + 4 + 2, st->attnflags, st->inflatework + INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE, ic);
+	} else if (!(mb->flags & CHUNK_SPARSE)) {
+		// in place: source is above destination
+		copylongs((ULONG*)dst, (ULONG*)sa, size / 4);
+	}
+	// uncompressed data pages are copied directly to their place
+	if (mb->flags & CHUNK_SPARSE)
+		expand_sparse(dst, (mb->flags & 1) ? dst : sa, mb->addr + 12);
+}
+
+// Lazy restore ("lazy", 68030 MMU mode): Slow and Fast RAM CHUNK_BLOCKS
+// banks are not decompressed before the program starts. Their pages are
+// left invalid, tagged with bank and block, and the first access to a page
+// decompresses its whole block (lazy_fault()). Zero filled blocks are
+// mapped write protected to one shared zero page, the first write to a
+// page maps its own RAM back and clears it.
+#define LAZY_TAG(bank, block) (((block) << 8) | ((bank) << 4) | 8)
+#define LAZY_ISTAG(desc) (((desc) & 15) == 8)
+// supervisor stack space restored with the bank: exception frames can't fault
+#define LAZY_STACK 8192
+
+// Other chunks (Chip, Slow) and the ROM image can be in the target space
+// of a bank, they are read through the old mapping after take over. The
+// bank's own chunk is done with once it is decompressed.
+static BOOL target_in_use(struct MemoryBank *mb, ULONG size, struct uaestate *st)
+{
+	for (WORD i = 0; i < st->num_allocations; i++) {
+		struct Allocation *a = &st->allocations[i];
+		if (a->addr == mb->addr)
+			continue;
+		if (a->addr < mb->targetaddr + size && a->addr + a->size > mb->targetaddr)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static BOOL in_extra_ram(UBYTE *p, ULONG size, struct uaestate *st)
+{
+	for (WORD idx = 0; idx < MAX_EXTRARAM; idx++) {
+		struct extraram *er = &st->eram[idx];
+		if (er->base && p >= er->base && p + size <= er->base + er->size)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// Lazy banks: chunk must stay in RAM nobody uses after take over, its
+// block size page aligned. The program's vectors must be at address 0:
+// bus errors go through the VBR table (createvbr()).
+static void lazy_banks(struct uaestate *st)
+{
+	if (!st->lazy)
+		return;
+	st->lazy = 0;
+	if (!st->vbr) {
+		printf("Out of memory, lazy restore not used.\n");
+		return;
+	}
+	if (!st->MMU_Level_A || (st->attnflags & AFF_68040) || !st->cpu_chunk) {
+		printf("Lazy restore needs 68030 MMU.\n");
+		return;
+	}
+	if (getlong(st->cpu_chunk, 0) < 68010 || getlong(st->cpu_chunk, 4+4+60+4+2+2+4+4+2+4+4+4) != 0) {
+		printf("Lazy restore not possible, state VBR is not zero.\n");
+		return;
+	}
+	for (int i = MB_SLOW; i < MEMORY_REGIONS; i++) {
+		struct MemoryBank *mb = &st->membanks[i];
+		if (!mb->addr || !(mb->flags & CHUNK_BLOCKS) || mb->delta)
+			continue;
+		UBYTE *p = mb->addr + 12;
+		ULONG size = getlong(p, 0);
+		if ((getlong(p, 4) & 4095) || (size & 4095))
+			continue;
+		if (!in_extra_ram(mb->addr, mb->size, st) || target_in_use(mb, size, st))
+			continue;
+		if (!map_region_tables(st, mb->targetaddr, size))
+			continue;
+		if (!st->zeropage) {
+			st->zeropage = extra_allocate(4096, 4096, st);
+			if (!st->zeropage)
+				continue;
+			memset(st->zeropage, 0, 4096);
+		}
+		mb->lazy = 1;
+		st->lazy++;
+		if (st->debug)
+			printf("Memory '%s': restored on first access.\n", mb->chunk);
+	}
+}
+
+// block is under one of the supervisor stack pointers of the state
+static BOOL lazy_stack(UBYTE *d, ULONG len, struct uaestate *st)
+{
+	ULONG sp[2];
+	sp[0] = getlong(st->cpu_chunk, 4+4+60+4+2+2+4);
+	sp[1] = getlong(st->cpu_chunk, 0) >= 68020 ? getlong(st->cpu_chunk, 4+4+60+4+2+2+4+4+2+4+4+4+4+4+4) : 0;
+	for (int i = 0; i < 2; i++) {
+		if (sp[i] && sp[i] + 16 > (ULONG)d && sp[i] - LAZY_STACK < (ULONG)d + len)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+// after take over: only blocks under the stacks and constant blocks are
+// restored now, other pages are tagged invalid
+static void lazy_bank(struct MemoryBank *mb, struct uaestate *st)
+{
+	UBYTE *p = mb->addr + 12;
+	ULONG blocks = getlong(p, 8);
+	ULONG blocksize = getlong(p, 4);
+	UBYTE *stack = st->inflatework + INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE;
+
+	st->inflatectx.buf = NULL;
+	for (ULONG i = 0; i < blocks; i++) {
+		ULONG size, len;
+		UBYTE *s = block_data(p, i, &size, &len);
+		UBYTE *d = mb->targetaddr + i * blocksize;
+		if (lazy_stack(d, len, st)) {
+			decode_block(d, len, s, size, mb->flags, st->attnflags, NULL, stack, &st->inflatectx);
+		} else if (size == 4 && getlong(s, 0) == 0) {
+			for (ULONG j = 0; j < len; j += 4096)
+				mmu_map_pages(st, d + j, st->zeropage, 4096, TRUE);
+		} else if (size == 4) {
+			fillmem((ULONG*)d, len / 4, getlong(s, 0));
+		} else {
+			tag_region(st, d, len, LAZY_TAG(mb - st->membanks, i));
+		}
+	}
+	flushmmu030();
+}
+
+// write to a shared zero page: map the page's own RAM, FALSE if addr is
+// not in a lazy bank or not a zero page
+static BOOL zero_page(ULONG addr, struct uaestate *st)
+{
+	UBYTE *d = (UBYTE*)(addr & ~4095);
+	ULONG desc = mmu_page(st, d);
+	if ((desc & 7) != 5 || (desc & ~4095) != (ULONG)st->zeropage)
+		return FALSE;
+	for (int i = MB_SLOW; i < MEMORY_REGIONS; i++) {
+		struct MemoryBank *mb = &st->membanks[i];
+		if (!mb->lazy || d < mb->targetaddr || d >= mb->targetaddr + getlong(mb->addr + 12, 0))
+			continue;
+		UBYTE *phys = mb->remapaddr ? mb->remapaddr + (d - mb->targetaddr) : d;
+		mmu_map_pages(st, d, phys, 4096, FALSE);
+		flushmmu030();
+		fillmem((ULONG*)d, 4096 / 4, 0);
+		return TRUE;
+	}
+	return FALSE;
+}
+
+// decompress the block of a tagged page, FALSE if addr is not lazy
+static BOOL lazy_page(ULONG addr, struct uaestate *st)
+{
+	ULONG desc = mmu_page(st, (void*)(addr & ~4095));
+	if (!LAZY_ISTAG(desc))
+		return FALSE;
+	struct MemoryBank *mb = &st->membanks[(desc >> 4) & 3];
+	UBYTE *p = mb->addr + 12;
+	ULONG i = desc >> 8;
+	ULONG size, len;
+	UBYTE *s = block_data(p, i, &size, &len);
+	UBYTE *d = mb->targetaddr + i * getlong(p, 4);
+	mmu_map_pages(st, d, mb->remapaddr ? mb->remapaddr + (d - mb->targetaddr) : d, len, FALSE);
+	flushmmu030();
+	st->inflatectx.buf = NULL;
+	decode_block(d, len, s, size, mb->flags, st->attnflags, NULL, st->inflatework + INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE, &st->inflatectx);
+	flushmmu030();
+	return TRUE;
+}
+
+// 68030 bus error after take over (asm.S lazyfault), interrupts disabled.
+// Data fault address and instruction stages C and B are checked. Returns 0
+// to rerun the faulted cycles, else the handler of a real bus error.
+static ULONG lazy_fault(UBYTE *frame, struct uaestate *st)
+{
+	UWORD ssw = getword(frame, 10);
+	ULONG pc = getlong(frame, 2);
+	BOOL done = FALSE;
+
+	// DF: data cycle, RW clear: write
+	if (ssw & 0x0100) {
+		done |= lazy_page(getlong(frame, 16), st);
+		if (!(ssw & 0x0040))
+			done |= zero_page(getlong(frame, 16), st);
+	}
+	// FC/FB: instruction prefetch, stage B address only in long frame
+	if (ssw & 0xc000) {
+		done |= lazy_page(pc + 2, st);
+		done |= lazy_page(pc + 4, st);
+		if ((getword(frame, 6) >> 12) == 0xb)
+			done |= lazy_page(getlong(frame, 0x24), st);
+	}
+	if (done)
+		return 0;
+	if (st->debug_entry)
+		return (ULONG)st->debug_entry;
+	return getlong(0, 8);
+}
+
+// bus error vector of the VBR table: PEA tempst.l, JMP lazyfault.l
+static void lazy_vector(struct uaestate *st, struct uaestate *tempst, ULONG *module, UBYTE *newcode)
+{
+	UBYTE *p = st->vbr + VBR_LAZYSTUB;
+	putword(p + 0, 0x4879);
+	putlong(p + 2, (ULONG)tempst);
+	putword(p + 6, 0x4ef9);
+	putlong(p + 8, (ULONG)lazyfault - (ULONG)module + (ULONG)newcode);
+	putlong(st->vbr + 2 * 4, (ULONG)p);
+	st->lazyfault = (ULONG(*)(UBYTE*, struct uaestate*))((ULONG)lazy_fault - (ULONG)module + (ULONG)newcode);
+}
+
+static void handlerambank(struct MemoryBank *mb, struct uaestate *st)
+{
+	if (mb->lazy) {
+		lazy_bank(mb, st);
+	} else if (mb->staged) {
+		// MMU remapped bank was decompressed directly to its physical RAM
+		if (mb->staged != mb->remapaddr)
+			copylongs((ULONG*)mb->targetaddr, (ULONG*)mb->staged, getlong(mb->addr + 12, 0) / 4);
+	} else {
+		struct inflatecontext *ic = &st->inflatectx;
+		ic->buf = NULL;
+		if (mb == &st->membanks[MB_CHIP] && st->chipwindow) {
+			ic->dst = mb->targetaddr;
+			ic->buf = ic->flushed = st->chipwindow;
+			ic->limit = st->chipwindow + st->chipwindowsize - 258;
+		}
+		decompress_bank(mb, mb->targetaddr, ic, st);
+	}
+	if (mb->delta)
+		patch_bank(mb->targetaddr, mb->delta);
+}
+
+// MMU mode: map Slow or Fast RAM address space to page aligned staging RAM,
+// the bank is not copied after take over. It is still decompressed before.
+static UBYTE *stage_remap(struct MemoryBank *mb, ULONG size, struct uaestate *st)
+{
+	// Chip RAM must stay real for custom chip DMA
+	if (!st->MMU_Level_A || mb == &st->membanks[MB_CHIP] || (size & 4095))
+		return NULL;
+	if (target_in_use(mb, size, st))
+		return NULL;
+	UBYTE *dst = extra_allocate(size, 4096, st);
+	if (!dst)
+		return NULL;
+	// descriptor tables first: on failure the bank keeps its old mapping
+	if (!map_region_tables(st, mb->targetaddr, size) || !map_region(st, mb->targetaddr, dst, size, FALSE, FALSE, FALSE, 0))
+		return NULL;
+	st->mmuused++;
+	mb->remapaddr = dst;
+	return dst;
+}
+
+// CHUNK_BLOCKS bank without room for all of it: decompress runs of blocks
+// to whatever free RAM is left, other blocks are decompressed after take over.
+static void stage_blocks(struct MemoryBank *mb, struct uaestate *st)
+{
+	UBYTE *p = mb->addr + 12;
+	ULONG blocks = getlong(p, 8);
+	ULONG blocksize = getlong(p, 4);
+	UBYTE *stack = st->inflatework + INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE;
+	ULONG staged = 0;
+
+	mb->blockstage = (UBYTE**)tempmem_allocate(blocks * sizeof(UBYTE*), TRUE, st);
+	if (!mb->blockstage)
+		return;
+	memset(mb->blockstage, 0, blocks * sizeof(UBYTE*));
+	st->inflatectx.buf = NULL;
+	for (ULONG i = 0; i < blocks; ) {
+		ULONG n = blocks - i;
+		UBYTE *d = NULL;
+		while (n && !(d = tempmem_allocate(n * blocksize, TRUE, st)))
+			n /= 2;
+		if (!d)
+			break;
+		for (ULONG j = 0; j < n; j++, i++) {
+			ULONG size, len;
+			UBYTE *s = block_data(p, i, &size, &len);
+			// constant blocks are only filled after take over
+			if (size == 4)
+				continue;
+			mb->blockstage[i] = d + j * blocksize;
+			decode_block(mb->blockstage[i], len, s, size, mb->flags, st->attnflags, NULL, stack, &st->inflatectx);
+			staged++;
+			uss_poll(st->file);
+		}
+	}
+	if (st->debug)
+		printf("Memory '%s': %lu of %lu blocks decompressed to free RAM.\n", mb->chunk, staged, blocks);
+	print_inflatestats(st, mb, &st->inflatectx);
+}
+
+// state file memory chunk read finished (async reads), FALSE if failed
+static BOOL membank_wait(struct MemoryBank *mb, struct uaestate *st)
+{
+	if (uss_wait(st->file, mb->addr))
+		return TRUE;
+	printf("ERROR: Read error (Chunk '%s').\n", mb->chunk);
+	return FALSE;
+}
+
+// Enough RAM: decompress banks while the system is still running, only a
+// copy (or nothing if MMU remapped) is left after system take over.
+// Each bank starts as soon as its own read has finished.
+static BOOL stage_banks(struct uaestate *st)
+{
+	for (int i = 0; i < MEMORY_REGIONS; i++) {
+		struct MemoryBank *mb = &st->membanks[i];
+		if (!mb->addr || !(mb->flags & 1) || mb->lazy)
+			continue;
+		if (!membank_wait(mb, st))
+			return FALSE;
+		ULONG size = getlong(mb->addr + 12, 0);
+		UBYTE *dst = mb->remapaddr;
+		if (!dst)
+			dst = stage_remap(mb, size, st);
+		if (!dst)
+			dst = tempmem_allocate(size, TRUE, st);
+		if (!dst) {
+			if (st->debug)
+				printf("Memory '%s': no staging RAM, decompressed after take over.\n", mb->chunk);
+			if (mb->flags & CHUNK_BLOCKS)
+				stage_blocks(mb, st);
+			continue;
+		}
+		st->inflatectx.buf = NULL;
+		decompress_bank(mb, dst, &st->inflatectx, st);
+		mb->staged = dst;
+		uss_poll(st->file);
+		if (st->debug)
+			printf("Memory '%s' decompressed to %08lx - %08lx.\n", mb->chunk, dst, dst + size - 1);
+		print_inflatestats(st, mb, &st->inflatectx);
+	}
+	return TRUE;
+}
+
+static const UWORD bench_cpus[] = { 0, AFF_68020, AFF_68040 };
+static const char *const bench_names[] = { "68000", "68020", "68040" };
+
+// inflate hot loop offset from 16-byte I-cache line boundary, 68020/030
+static const UBYTE bench_hotalign[] = { 0, 2 };
+static const char *const bench_hotnames[] = { "68020 aligned", "68020 misaligned" };
+
+// inflate variant hot loop (I-cache aligned when relocated)
+static UBYTE *inflate_hotloop(UWORD attnflags)
+{
+	if (attnflags & AFF_68040)
+		return inflate040_hot;
+	if (attnflags & AFF_68020)
+		return inflate020_hot;
+	return inflate_hot;
+}
+
+static LONG print_speed(const char *what, struct MemoryBank *mb, const char *name, ULONG size, struct DateStamp *ds1, struct DateStamp *ds2)
+{
+	LONG ticks = ((ds2->ds_Days - ds1->ds_Days) * 24 * 60 + ds2->ds_Minute - ds1->ds_Minute) * 60 * TICKS_PER_SECOND + ds2->ds_Tick - ds1->ds_Tick;
+	if (ticks <= 0)
+		ticks = 1;
+	printf("%s '%s' %s: %luk in %lu.%02lus, %lu kB/s", what, mb->chunk, name, size >> 10,
+		ticks / TICKS_PER_SECOND, (ticks % TICKS_PER_SECOND) * (100 / TICKS_PER_SECOND),
+		(size >> 10) * TICKS_PER_SECOND / ticks);
+	return ticks;
+}
+
+#if INFLATE_STATS
+// decode profile of a zlib bank (make STATS=1), counters restart afterwards
+static void print_inflatestats(struct uaestate *st, struct MemoryBank *mb, struct inflatecontext *ic)
+{
+	struct inflatestats *s = &ic->stats;
+	if ((st->debug || st->testmode) && (mb->flags & (CHUNK_LZ4 | 1)) == 1) {
+		printf("Inflate '%s': %lu stored, %lu static (%lu cached), %lu dynamic blocks, %lu table builds.\n",
+			mb->chunk, s->blocks[0], s->blocks[1], s->cached, s->blocks[2],
+			s->blocks[1] + s->blocks[2] - s->cached);
+		printf(" %lu literals (%lu pairs), %lu matches, %lu tree walks.\n",
+			s->literals, s->pairs, s->matches, s->treewalks);
+		printf(" Match lengths 3/4-7/8-15/../256-258:");
+		for (int i = 0; i < 8; i++)
+			printf(" %lu", s->lengths[i]);
+		printf("\n");
+	}
+	memset(s, 0, sizeof(struct inflatestats));
+}
+#else
+#define print_inflatestats(st, mb, ic)
+#endif
+
+// CHUNK_BLOCKS: number of decompressed blocks that don't match their Adler-32
+static ULONG check_blocks(struct MemoryBank *mb, UBYTE *dst)
+{
+	UBYTE *p = mb->addr + 12;
+	ULONG bad = 0;
+	for (ULONG i = 0; i < getlong(p, 8); i++) {
+		ULONG size, len;
+		UBYTE *s = block_data(p, i, &size, &len);
+		if (size > 4 && adler32(1, dst + i * getlong(p, 4), len) != getlong(s, size - 4))
+			bad++;
+	}
+	return bad;
+}
+
+static void bench_run(struct uaestate *st, struct MemoryBank *mb, const char *name, UBYTE *dst, UBYTE *work, UWORD cpu, void *code)
+{
+	ULONG datasize;
+	UBYTE *sa = membank_data(mb, &datasize);
+	ULONG size = getlong(sa, 0);
+	ULONG adler = getlong(sa, datasize - 4);
+	UBYTE *stack = work + INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE;
+	struct inflatecontext ic = { 0 };
+	struct DateStamp ds1, ds2;
+
+	// variants have different table layouts
+	ic.tables = work;
+	ic.tablessize = INFLATE_TABLES_SIZE;
+	ic.burst = BURST_RAM(dst);
+	*(ULONG*)work = 0;
+	DateStamp(&ds1);
+	if (mb->flags & CHUNK_BLOCKS)
+		decode_blocks(mb, dst, cpu, code, stack, &ic);
+	else if (mb->flags & CHUNK_LZ4)
+		unlz4(dst, sa + 4, dst + size);
+	else if (code)
+		callinflatecode(dst, sa + 4 + 2, code, stack, &ic);
+	else
+		callinflate(dst, sa + 4 + 2, cpu, stack, &ic);
+	DateStamp(&ds2);
+	LONG ticks = print_speed("Bench", mb, name, size, &ds1, &ds2);
+	if (st->benchmhz) {
+		ULONG uskb = ticks * (1000000 / TICKS_PER_SECOND) / ((size + 1023) >> 10);
+		printf(", %lu cycles/byte @ %luMHz", uskb * st->benchmhz / 1024, st->benchmhz);
+	}
+	if (mb->flags & CHUNK_BLOCKS) {
+		ULONG bad = check_blocks(mb, dst);
+		if (bad)
+			printf(" ADLER32 MISMATCH (%lu blocks)", bad);
+	} else if (adler32(1, dst, size) != adler) {
+		printf(" ADLER32 MISMATCH");
+	}
+	printf(".\n");
+}
+
+// 68020/030: run relocated copies of 68020 inflate with hot loop aligned and misaligned
+static void bench_alignment(struct uaestate *st, struct MemoryBank *mb, UBYTE *dst, UBYTE *work)
+{
+	ULONG len = inflate020_end - inflate020_start;
+	ULONG hotoffset = inflate020_hot - inflate020_start;
+	UBYTE *mem = AllocMem(len + 16, MEMF_ANY);
+	if (!mem)
+		return;
+	for (int i = 0; i < sizeof(bench_hotalign); i++) {
+		UBYTE *code = mem + ((bench_hotalign[i] - (ULONG)mem - hotoffset) & 15);
+		memcpy(code, inflate020_start, len);
+		if (SysBase->LibNode.lib_Version >= 37)
+			flushcache();
+		bench_run(st, mb, bench_hotnames[i], dst, work, 0, code + (inflate020 - inflate020_start));
+	}
+	FreeMem(mem, len + 16);
+}
+
+// decompress all compressed banks with every inflate variant this CPU can run,
+// LZ4 banks (usspack) with the LZ4 decompressor
+static void bench_inflate(struct uaestate *st)
+{
+	if (!uss_wait(st->file, NULL))
+		return;
+	for (int i = 0; i < MEMORY_REGIONS; i++) {
+		struct MemoryBank *mb = &st->membanks[i];
+		if (!mb->addr || !(mb->flags & 1))
+			continue;
+		ULONG datasize;
+		ULONG size = getlong(membank_data(mb, &datasize), 0);
+		if (!size)
+			continue;
+		ULONG allocsize = size + 4 + INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE;
+		UBYTE *dst = AllocMem(allocsize, MEMF_ANY);
+		if (!dst) {
+			printf("Bench '%s': Not enough memory (%luk).\n", mb->chunk, size >> 10);
+			continue;
+		}
+		// inflate needs more stack than default CLI stack
+		UBYTE *work = (UBYTE*)(((ULONG)dst + size + 3) & ~3);
+		if (mb->flags & CHUNK_LZ4) {
+			bench_run(st, mb, "LZ4", dst, work, 0, NULL);
+			FreeMem(dst, allocsize);
+			continue;
+		}
+		for (int j = 0; j < sizeof(bench_cpus) / sizeof(UWORD); j++) {
+			if (bench_cpus[j] && !(st->attnflags & bench_cpus[j]))
+				continue;
+			bench_run(st, mb, bench_names[j], dst, work, bench_cpus[j], NULL);
+		}
+		if ((st->attnflags & AFF_68020) && !(st->attnflags & AFF_68040))
+			bench_alignment(st, mb, dst, work);
+		FreeMem(dst, allocsize);
+	}
+}
+
+// CHUNK_BLOCKS: each block is checked on its own, staged blocks directly,
+// others through a one block buffer on any CPU. Corrupt blocks are listed
+// by address.
+static BOOL verify_blocks(struct uaestate *st, struct MemoryBank *mb)
+{
+	UBYTE *p = mb->addr + 12;
+	ULONG blocks = getlong(p, 8);
+	ULONG blocksize = getlong(p, 4);
+	UBYTE *stack = st->inflatework + INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE;
+	struct inflatecontext ic = { 0 };
+	struct DateStamp ds1, ds2;
+	UBYTE *buf = NULL;
+	ULONG i, bad = 0;
+
+	ic.tables = st->inflatework;
+	ic.tablessize = INFLATE_TABLES_SIZE;
+	DateStamp(&ds1);
+	for (i = 0; i < blocks; i++) {
+		ULONG size, len;
+		UBYTE *s = block_data(p, i, &size, &len);
+		UBYTE *d;
+		if (size == 4)
+			continue;
+		if (mb->staged)
+			d = mb->staged + i * blocksize;
+		else if (mb->blockstage && mb->blockstage[i])
+			d = mb->blockstage[i];
+		else if (buf || (buf = AllocMem(blocksize, MEMF_ANY)))
+			decode_block(d = buf, len, s, size, mb->flags, st->attnflags, NULL, stack, &ic);
+		else
+			break;
+		if (adler32(1, d, len) != getlong(s, size - 4)) {
+			if (!bad)
+				printf("ERROR: Memory state '%s' is corrupt:", mb->chunk);
+			printf(" %08lx-%08lx", mb->targetaddr + i * blocksize, mb->targetaddr + i * blocksize + len - 1);
+			bad++;
+		}
+		uss_poll(st->file);
+	}
+	DateStamp(&ds2);
+	if (buf)
+		FreeMem(buf, blocksize);
+	if (bad) {
+		printf("\n");
+		return FALSE;
+	}
+	if (i < blocks) {
+		printf("Verify '%s': Not enough memory (%luk), not verified.\n", mb->chunk, blocksize >> 10);
+		return TRUE;
+	}
+	print_speed("Verify", mb, "blocks", getlong(p, 0), &ds1, &ds2);
+	printf(", OK.\n");
+	if (!mb->staged)
+		print_inflatestats(st, mb, &ic);
+	return TRUE;
+}
+
+// Decode before system take over and compare with the stream's Adler-32:
+// corrupt data would hang the machine after the point of no return.
+static BOOL verify_bank(struct uaestate *st, struct MemoryBank *mb)
+{
+	if (mb->flags & CHUNK_BLOCKS)
+		return verify_blocks(st, mb);
+	ULONG datasize;
+	UBYTE *sa = membank_data(mb, &datasize);
+	ULONG size = getlong(sa, 0);
+	ULONG adler = getlong(sa, datasize - 4);
+	UBYTE *stack = st->inflatework + INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE;
+	struct inflatecontext ic = { 0 };
+	struct DateStamp ds1, ds2;
+	const char *name = "staged";
+	ULONG check;
+
+	ic.tables = st->inflatework;
+	ic.tablessize = INFLATE_TABLES_SIZE;
+	DateStamp(&ds1);
+	if (mb->staged && !(mb->flags & CHUNK_SPARSE)) {
+		// already decompressed
+		check = adler32(1, mb->staged, size);
 	} else {
-		ULONG *s = (ULONG*)sa;
-		ULONG *d = (ULONG*)mb->targetaddr;
-		for (int i = 0; i < mb->size / 4; i++) {
-			*d++ = *s++;
-		}		
+		ULONG bufsize = VERIFY_WINDOW;
+		UBYTE *buf = NULL;
+		// 68020+ inflate can decode through a window without storing the output
+		if ((st->attnflags & AFF_68020) && !(mb->flags & CHUNK_LZ4)) {
+			buf = AllocMem(bufsize, MEMF_ANY);
+			if (!buf) {
+				bufsize = STAGING_MIN;
+				buf = AllocMem(bufsize, MEMF_ANY);
+			}
+		}
+		if (buf) {
+			name = "check only";
+			ic.buf = ic.flushed = buf;
+			ic.limit = buf + bufsize - 258;
+			ic.sink = adler32;
+			ic.sinkdata = 1;
+			ic.burst = BURST_RAM(buf);
+			callinflate(buf, sa + 4 + 2, st->attnflags, stack, &ic);
+			check = ic.sinkdata;
+		} else {
+			name = "decoded";
+			bufsize = size;
+			buf = AllocMem(bufsize, MEMF_ANY);
+			if (!buf) {
+				printf("Verify '%s': Not enough memory (%luk), not verified.\n", mb->chunk, size >> 10);
+				return TRUE;
+			}
+			ic.burst = BURST_RAM(buf);
+			if (mb->flags & CHUNK_LZ4)
+				unlz4(buf, sa + 4, buf + size);
+			else
+				callinflate(buf, sa + 4 + 2, st->attnflags, stack, &ic);
+			check = adler32(1, buf, size);
+		}
+		FreeMem(buf, bufsize);
+	}
+	DateStamp(&ds2);
+	print_speed("Verify", mb, name, size, &ds1, &ds2);
+	if (check != adler) {
+		printf(" ADLER32 MISMATCH.\n");
+		printf("ERROR: Memory state '%s' is corrupt.\n", mb->chunk);
+		return FALSE;
+	}
+	printf(", OK.\n");
+	if (!mb->staged)
+		print_inflatestats(st, mb, &ic);
+	return TRUE;
+}
+
+static BOOL verify_banks(struct uaestate *st)
+{
+	for (int i = 0; i < MEMORY_REGIONS; i++) {
+		struct MemoryBank *mb = &st->membanks[i];
+		if (mb->addr && (mb->flags & 1) && (!membank_wait(mb, st) || !verify_bank(st, mb)))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+// Chip RAM is slow compared to accelerator Fast RAM: decompress it
+// through a Fast RAM staging buffer, flushed to Chip RAM with longword writes.
+static void allocate_chipwindow(struct uaestate *st)
+{
+	struct MemoryBank *mb = &st->membanks[MB_CHIP];
+	if (!(st->attnflags & AFF_68020) || !mb->addr || !(mb->flags & 1) || (mb->flags & CHUNK_LZ4) || mb->staged)
+		return;
+	if (mem_weight(st->eram[0].base) < 2)
+		return;
+	// whole bank if possible, no flushing needed until the end
+	ULONG datasize;
+	ULONG size = getlong(membank_data(mb, &datasize), 0) + 512;
+	for (;;) {
+		if (size < STAGING_MIN)
+			size = STAGING_MIN;
+		UBYTE *b = tempmem_allocate(size + 16, TRUE, st);
+		if (b) {
+			if (mem_weight(b) < 2)
+				return;
+			// same 16-byte alignment as Chip RAM target
+			st->chipwindow = (UBYTE*)(((ULONG)b + 15) & ~15);
+			st->chipwindowsize = size;
+			if (st->debug)
+				printf("Chip RAM staging buffer %08lx-%08lx.\n", st->chipwindow, st->chipwindow + size - 1);
+			return;
+		}
+		if (size == STAGING_MIN)
+			return;
+		size /= 2;
 	}
 }
 
@@ -2114,6 +3097,12 @@ static void processstate(struct uaestate *st)
 			handlerambank(mb, st);
 		}
 	}
+
+	if (st->copyback[0].size) {
+		// back to final cache mode, write back decompressed data
+		mmu_copyback(st, FALSE);
+		flushmmu040();
+	}
 	
 	c->color[0] = 0x440;
 		
@@ -2161,6 +3150,10 @@ static void take_over(struct uaestate *st)
 {
 
 	createvbr(st);
+	lazy_banks(st);
+	// VBR table only for the debugger or lazy bus errors
+	if (!st->debug_entry && !st->lazy)
+		st->vbr = NULL;
 	
 	// Copy stack, variables and code to safe location
 
@@ -2173,13 +3166,49 @@ static void take_over(struct uaestate *st)
 	ULONG *module = (ULONG*)(cli->cli_Module << 2);
 	ULONG hunksize = module[-1];
 
-	UBYTE *newcode = tempmem_allocate(hunksize + TEMP_STACK_SIZE + sizeof(struct uaestate), TRUE, st);
-	if (!newcode) {
-		printf("Out of memory, %ld bytes required.\n", hunksize + TEMP_STACK_SIZE + sizeof(struct uaestate));
+	ULONG newsize = hunksize + 16 + TEMP_STACK_SIZE + sizeof(struct uaestate);
+	UBYTE *newmem = tempmem_allocate(newsize, TRUE, st);
+	if (!newmem) {
+		printf("Out of memory, %ld bytes required.\n", newsize);
+		return;
+	}
+	// inflate hot loop starts at I-cache line boundary
+	UBYTE *newcode = newmem + ((-((ULONG)newmem + (ULONG)inflate_hotloop(st->attnflags) - (ULONG)module)) & 15);
+	// inflate lookup tables: fastest RAM left after the code
+	st->inflatework = tempmem_allocate(INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE, TRUE, st);
+	if (!st->inflatework) {
+		printf("Out of memory, %ld bytes required.\n", INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE);
 		return;
 	}
-	UBYTE *tempsp = newcode + hunksize;
+	st->inflatectx.tables = st->inflatework;
+	st->inflatectx.tablessize = INFLATE_TABLES_SIZE;
+	*(ULONG*)st->inflatework = 0;
+	if (!stage_banks(st))
+		return;
+	if (st->verify && !verify_banks(st))
+		return;
+	allocate_chipwindow(st);
+	// uncompressed banks
+	if (!uss_wait(st->file, NULL)) {
+		printf("ERROR: Read error (memory chunks).\n");
+		return;
+	}
+
+	// decompress at cache speed: target banks and work areas copyback cached
+	mmu_add_copyback(st, newmem, newsize);
+	mmu_add_copyback(st, st->inflatework, INFLATE_TABLES_SIZE + INFLATE_STACK_SIZE);
+	mmu_add_copyback(st, st->chipwindow, st->chipwindowsize);
+	for (int i = MB_SLOW; i < MEMORY_REGIONS; i++) {
+		struct MemoryBank *mb = &st->membanks[i];
+		if (mb->addr)
+			mmu_add_copyback(st, mb->targetaddr, mb->targetsize);
+	}
+	mmu_copyback(st, TRUE);
+
+	UBYTE *tempsp = newmem + 16 + hunksize;
 	struct uaestate *tempst = (struct uaestate*)(tempsp + TEMP_STACK_SIZE);
+	if (st->lazy)
+		lazy_vector(st, tempst, module, newcode);
 	memcpy(tempst, st, sizeof(struct uaestate));
 	memcpy(newcode, module, hunksize);
 	
@@ -2192,7 +3221,7 @@ static void take_over(struct uaestate *st)
 			ULONG *ap = (ULONG*)(cp + 1);
 			ULONG *app = (ULONG*)(*ap);
 			void *addr = (void*)app;
-			if (addr == runit || addr == callinflate) {
+			if (addr == runit || addr == callinflate || addr == flushmmu040 || addr == flushmmu030 || addr == lazyfault || addr == unlz4 || addr == fillmem || addr == adler32) {
 				*ap = (ULONG)addr - (ULONG)module + (ULONG)newcode;
 				//printf("Relocated %08x: %08x -> %08x\n", cp, addr, *ap);
 			}
@@ -2236,7 +3265,8 @@ static void take_over(struct uaestate *st)
 
 int main(int argc, char *argv[])
 {
-	FILE *f;
+	struct ussfile *f, *delta = NULL;
+	UBYTE basename[256];
 	UBYTE *b;
 	ULONG size;
 	UBYTE cname[5];
@@ -2244,7 +3274,7 @@ int main(int argc, char *argv[])
 	
 	printf("ussload v" VER " (" REVDATE " " REVTIME ")\n");
 	if (argc < 2) {
-		printf("Syntax: ussload <statefile.uss> (parameters).\n");
+		printf("Syntax: ussload <statefile.uss|.uss.gz|.zip|delta.uss|bundle:state> (parameters).\n");
 		printf("- nowait = don't wait for return key.\n");
 		printf("- debug = enable debug output.\n");
 		printf("- test = test mode.\n");
@@ -2257,15 +3287,12 @@ int main(int argc, char *argv[])
 		printf("- pal/ntsc = set PAL or NTSC mode (ECS/AGA only).\n");
 		printf("- nofloppy = don't initialize floppy drives.\n");
 		printf("- generic/cdtv/cd32 = override hardware type autodetection.\n");
+		printf("- bench [mhz] = benchmark decompression of memory banks.\n");
+		printf("- verify/noverify = check memory state before take over (default on 68020+).\n");
+		printf("- lazy = restore Slow/Fast RAM blocks on first access (68030 MMU, usspack -B).\n");
 		return 0;
 	}
 	
-	f = fopen(argv[1], "rb");
-	if (!f) {
-		printf("Couldn't open '%s'\n", argv[1]);
-		return 0;
-	}
-
 	st = calloc(sizeof(struct uaestate), 1);
 	if (!st) {
 		printf("Out of memory.\n");
@@ -2274,6 +3301,7 @@ int main(int argc, char *argv[])
 	st->usemaprom = 1;
 	st->canusemmu = 1;
 	st->hwtype = -1;
+	st->verify = 2;
 	for(int i = 2; i < argc; i++) {
 		if (!stricmp(argv[i], "debug"))
 			st->debug = 1;
@@ -2305,6 +3333,19 @@ int main(int argc, char *argv[])
 			st->hwtype = HWTYPE_CDTV;
 		if (!stricmp(argv[i], "cd32"))
 			st->hwtype = HWTYPE_CD32;
+		if (!stricmp(argv[i], "bench")) {
+			st->bench = 1;
+			if (i + 1 < argc) {
+				char *p;
+				st->benchmhz = strtoul(argv[i + 1], &p, 10);
+			}
+		}
+		if (!stricmp(argv[i], "verify"))
+			st->verify = 1;
+		if (!stricmp(argv[i], "noverify"))
+			st->verify = 0;
+		if (!stricmp(argv[i], "lazy"))
+			st->lazy = 1;
 		if (!stricmp(argv[i], "trap")) {
 			if (i + 1 < argc) {
 				char *p;
@@ -2323,8 +3364,40 @@ int main(int argc, char *argv[])
 	
 	UWORD attnFlags = SysBase->AttnFlags;
 	st->attnflags = attnFlags;
+	if (st->verify == 2)
+		st->verify = (attnFlags & AFF_68020) != 0;
 
-	if ((attnFlags & AFF_68030) && !(attnFlags & AFF_68040) && st->canusemmu == 1) {
+	// gzip/zip container is decompressed with the CPU's inflate
+	f = uss_open(argv[1], st);
+	if (!f) {
+		free(st);
+		return 0;
+	}
+	// delta state file: memory state and configuration from its base
+	int isdelta = delta_base(f, argv[1], basename, sizeof basename);
+	if (isdelta) {
+		delta = f;
+		f = NULL;
+		if (isdelta > 0) {
+			printf("Delta state file, base '%s'.\n", basename);
+			f = uss_open(basename, st);
+		}
+		if (f && delta_base(f, "", basename, sizeof basename)) {
+			printf("ERROR: Base state file is a delta state file.\n");
+			uss_close(f);
+			f = NULL;
+		}
+		if (!f) {
+			uss_close(delta);
+			free(st);
+			return 0;
+		}
+	}
+	// memory chunk reads can still be in flight during take over preparation
+	st->file = f;
+
+	// lazy restore needs the MMU, 68030 too
+	if ((attnFlags & AFF_68030) && !(attnFlags & AFF_68040) && st->canusemmu == 1 && !st->lazy) {
 		st->canusemmu = 0;
 	}
 
@@ -2368,12 +3441,14 @@ int main(int argc, char *argv[])
 		for (int i = 0; i < MEMORY_REGIONS; i++) {
 			st->mem_allocated[i] = NULL;
 		}
-		fseek(f, 0, SEEK_SET);
+		uss_seek(f, 0, SEEK_SET);
 	}
 
 	if (!parse_pass_1(f, FALSE, st)) {
-		fseek(f, 0, SEEK_SET);
-		if (!parse_pass_2(f, st)) {
+		uss_seek(f, 0, SEEK_SET);
+		if (!parse_pass_2(f, delta, st)) {
+			if (st->bench)
+				bench_inflate(st);
 			take_over(st);			
 		} else {
 			printf("Pass #2 failed.\n");
@@ -2386,7 +3461,9 @@ end:
 	
 	free(st);
 	
-	fclose(f);
+	uss_close(f);
+	if (delta)
+		uss_close(delta);
 
 	free_allocations(st);
 
@@ -84,9 +84,28 @@ static ULONG alloc_descriptor(struct uaestate *st, UBYTE bits, UBYTE level)
 	return dout;
 }	
 		
+/* Page descriptor of addr, missing descriptor tables are allocated */
+static ULONG *page_descriptor(struct uaestate *st, void *addr)
+{
+	ULONG desca, descb;
+
+	desca = LEVELA(st->MMU_Level_A, addr);
+	if (ISINVALID(desca))
+			desca = LEVELA(st->MMU_Level_A, addr) = alloc_descriptor(st, LEVELB_SIZE, 1);
+	if (ISINVALID(desca))
+			return NULL;
+	descb = LEVELB(desca, addr);
+	if (ISINVALID(descb))
+			descb = LEVELB(desca, addr) = alloc_descriptor(st, LEVELC_SIZE, 2);
+	if (ISINVALID(descb))
+			return NULL;
+	return &LEVELC(descb, addr);
+}
+
 static BOOL map_region2(struct uaestate *st, void *addr, void *physaddr, ULONG size, BOOL invalid, BOOL writeprotect, BOOL supervisor, UBYTE cachemode)
 {
-	ULONG desca, descb, descc, pagedescriptor;
+	ULONG descc, pagedescriptor;
+	ULONG *desc;
 	ULONG page_size = 1 << PAGE_SIZE;
 	ULONG page_mask = page_size - 1;
 
@@ -96,17 +115,10 @@ static BOOL map_region2(struct uaestate *st, void *addr, void *physaddr, ULONG s
 			physaddr = addr;
 
 	while (size) {
-		desca = LEVELA(st->MMU_Level_A, addr);
-		if (ISINVALID(desca))
-				desca = LEVELA(st->MMU_Level_A, addr) = alloc_descriptor(st, LEVELB_SIZE, 1);
-		if (ISINVALID(desca))
-				return FALSE;
-		descb = LEVELB(desca, addr);
-		if (ISINVALID(descb))
-				descb = LEVELB(desca, addr) = alloc_descriptor(st, LEVELC_SIZE, 2);
-		if (ISINVALID(descb))
+		desc = page_descriptor(st, addr);
+		if (!desc)
 				return FALSE;
-		descc = LEVELC(descb, addr);
+		descc = *desc;
 
 		if (invalid) {
 			pagedescriptor = INVALID_DESCRIPTOR;
@@ -136,7 +148,7 @@ static BOOL map_region2(struct uaestate *st, void *addr, void *physaddr, ULONG s
 			}
 		}
 
-		LEVELC(descb, addr) = pagedescriptor;
+		*desc = pagedescriptor;
 		size -= page_size;
 		addr += page_size;
 		physaddr += page_size;
@@ -156,6 +168,60 @@ BOOL map_region(struct uaestate *st, void *addr, void *physaddr, ULONG size, BOO
 	return TRUE;
 }
 
+/* Allocate all descriptor tables of a region without changing its pages:
+ * map_region() of the region can't fail halfway afterwards. */
+BOOL map_region_tables(struct uaestate *st, void *addr, ULONG size)
+{
+	ULONG page_size = 1 << PAGE_SIZE;
+
+	for (UBYTE *p = addr; size >= page_size; size -= page_size, p += page_size) {
+		if (!page_descriptor(st, p))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Leave the pages of a region invalid with a software tag in their
+ * descriptor: bits 2-31 of a 68030 invalid descriptor are not used by the
+ * MMU. Tag bits 0-1 must be zero. */
+BOOL tag_region(struct uaestate *st, void *addr, ULONG size, ULONG tag)
+{
+	ULONG page_size = 1 << PAGE_SIZE;
+
+	for (UBYTE *p = addr; size >= page_size; size -= page_size, p += page_size) {
+		ULONG *desc = page_descriptor(st, p);
+		if (!desc)
+			return FALSE;
+		*desc = tag;
+	}
+	return TRUE;
+}
+
+/* Page descriptor of addr, INVALID_DESCRIPTOR if there are no descriptor
+ * tables for it. Nothing is allocated: usable after take over. */
+ULONG mmu_page(struct uaestate *st, void *addr)
+{
+	ULONG desca = LEVELA(st->MMU_Level_A, addr);
+	if (ISINVALID(desca))
+		return INVALID_DESCRIPTOR;
+	ULONG descb = LEVELB(desca, addr);
+	if (ISINVALID(descb))
+		return INVALID_DESCRIPTOR;
+	return LEVELC(descb, addr);
+}
+
+/* Map pages of a region with the default cache mode of init_mmu(), old
+ * write protection is not kept. No messages: usable after take over if
+ * the descriptor tables already exist. Caller flushes the ATC. */
+BOOL mmu_map_pages(struct uaestate *st, void *addr, void *physaddr, ULONG size, BOOL writeprotect)
+{
+	UBYTE cachemode = (st->flags & (FLAGS_NOCACHE | FLAGS_NOCACHE2)) ? CM_NONCACHEABLE : CM_WRITETHROUGH;
+
+	if (!map_region2(st, addr, NULL, size, TRUE, FALSE, FALSE, 0))
+		return FALSE;
+	return map_region2(st, addr, physaddr, size, FALSE, writeprotect, FALSE, cachemode);
+}
+
 BOOL unmap_region(struct uaestate *st, void *addr, ULONG size)
 {
 	if (st->debug)
@@ -197,3 +263,49 @@ BOOL init_mmu(struct uaestate *st)
 		
 	return TRUE;
 }
+
+/* Add region that is copyback cached while state is decompressed (68040/060) */
+void mmu_add_copyback(struct uaestate *st, void *addr, ULONG size)
+{
+	ULONG page_mask = (1 << PAGE_SIZE) - 1;
+
+	if (!st->MMU_Level_A || st->mmutype < MMU040 || !addr || !size)
+		return;
+	for (WORD i = 0; i < MAX_COPYBACK; i++) {
+		struct cbregion *cb = &st->copyback[i];
+		if (!cb->size) {
+			cb->addr = (UBYTE*)(((ULONG)addr) & ~page_mask);
+			cb->size = ((((ULONG)addr) + size + page_mask) & ~page_mask) - (ULONG)cb->addr;
+			if (st->debug)
+				printf("MMU: Copyback %08lx-%08lx\n", cb->addr, cb->addr + cb->size - 1);
+			return;
+		}
+	}
+}
+
+/* Switch write-through pages of copyback regions to copyback or back.
+ * Non-cacheable pages are not touched. Caller must flush caches and ATC
+ * if MMU is already enabled. */
+void mmu_copyback(struct uaestate *st, BOOL enable)
+{
+	ULONG page_size = 1 << PAGE_SIZE;
+	UBYTE from = enable ? CM_WRITETHROUGH : CM_COPYBACK;
+	UBYTE to = enable ? CM_COPYBACK : CM_WRITETHROUGH;
+
+	for (WORD i = 0; i < MAX_COPYBACK; i++) {
+		struct cbregion *cb = &st->copyback[i];
+		UBYTE *addr = cb->addr;
+		for (ULONG size = cb->size; size; size -= page_size, addr += page_size) {
+			ULONG desca = LEVELA(st->MMU_Level_A, addr);
+			if (ISINVALID(desca))
+				continue;
+			ULONG descb = LEVELB(desca, addr);
+			if (ISINVALID(descb))
+				continue;
+			ULONG descc = LEVELC(descb, addr);
+			if (ISINVALID(descc) || ((descc >> 5) & 3) != from)
+				continue;
+			LEVELC(descb, addr) = (descc & ~(3 << 5)) | (to << 5);
+		}
+	}
+}
@@ -0,0 +1,1293 @@
+
+/* State file reader: plain UAE state files, gzip (.uss.gz) or zip
+ * containers and state bundles (bundle:statename).
+ *
+ * The inflate code can't suspend, so the compressed container is read to
+ * RAM and decoded in one go through a small window (OPT_WINDOW sink). The
+ * first decode follows the chunk structure and keeps everything except
+ * memory chunk data, only its first bytes are needed by the parse passes.
+ * Memory chunk reads are queued by uss_load() and done by uss_fetch() in
+ * a second decode, straight to their load addresses: the state file is
+ * never expanded in RAM. Zip entries that are stored are read directly.
+ *
+ * The second decode is skipped for memory chunks whose data the first one
+ * could hold: only in RAM above the 24-bit address space, where no memory
+ * bank is loaded, and only with HOLD_RESERVE left over. Otherwise (most
+ * 68000 and 68020 systems) the container is still decoded twice. The first
+ * decode checks the gzip or zip CRC-32 of the whole state file.
+ *
+ * A plain state file (or stored zip entry) is scanned once from start to
+ * end and kept the same way: the parse passes run from RAM and only skip
+ * forward over memory chunk data in the file. Queued memory chunk reads
+ * are done in file order by uss_fetch(), one seek each.
+ *
+ * Bulk reads (memory chunks, compressed container, bundle pages and ROM
+ * images) bypass stdio: dos.library Read() goes straight to the destination
+ * in pieces no larger than the device's MaxTransfer.
+ *
+ * Indexed file memory chunk reads are asynchronous: uss_fetch() sends
+ * ACTION_SEEK and ACTION_READ packets to the file system and returns, the
+ * rest of pass 2 runs while the controller transfers. Only one packet is
+ * in flight, the next one goes out when its reply is collected (uss_read()
+ * or uss_wait()): a read never depends on the handler keeping packet order
+ * and only follows a successful seek. uss_wait() waits for one memory
+ * chunk or all of them.
+ *
+ * A native state file (usspack -N) is already laid out for this: its
+ * table of contents and small chunks are read in one go and kept, memory
+ * chunks are read like an indexed file, page aligned in the file.
+ *
+ * A bundle (usspack -b) state is read like an uncompressed state file:
+ * its chunks are kept, memory chunks are page lists and each page is read
+ * from the shared bundle page data when that part is read. Uncompressed
+ * pages that follow each other in the file are read in one go, LZ4 pages
+ * are decompressed through a page buffer.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <exec/types.h>
+#include <exec/memory.h>
+#include <exec/execbase.h>
+#include <proto/exec.h>
+#include <proto/dos.h>
+#include <dos/dosextens.h>
+#include <dos/filehandler.h>
+
+#include "header.h"
+
+extern void callinflate(UBYTE*, UBYTE*, ULONG, UBYTE*, struct inflatecontext*);
+extern void callinflatecode(UBYTE*, UBYTE*, void*, UBYTE*, struct inflatecontext*);
+extern UBYTE inflatewin[];
+extern void unlz4(UBYTE*, UBYTE*, UBYTE*);
+
+// sink calls C library and memory allocation functions
+#define SINK_STACK_SIZE 4096
+// chunk padding and short gaps are read, not seeked over
+#define SCAN_SKIP 16
+// bulk read bounce buffer, destination not reachable by device DMA
+#define BOUNCE_SIZE 65536
+// async read piece when MaxTransfer is not limited: early chunks finish early
+#define ASYNC_PIECE (256 * 1024)
+// free RAM left after holding memory chunk data from the first decode and
+// allocating its load buffer
+#define HOLD_RESERVE (1024 * 1024)
+// zip end of central directory record and its longest comment
+#define ZIP_EOCD 22
+#define ZIP_EOCD_MAX (ZIP_EOCD + 65535)
+
+// kept range of the decompressed state file
+struct segment
+{
+	ULONG offset;
+	ULONG size;
+	ULONG spool; // offset in spool
+	ULONG file; // bundle page data file offset or BUNDLE_ZERO, 0 = spool
+	ULONG packed; // bundle: LZ4 page size, 0 = uncompressed
+};
+
+// queued memory chunk read
+struct fetch
+{
+	ULONG offset;
+	ULONG size;
+	UBYTE *dst;
+};
+
+// async read or seek, replied to the ussfile's port
+struct asyncpacket
+{
+	struct StandardPacket sp;
+	UBYTE *dst; // memory chunk the packet belongs to
+};
+
+struct ussfile
+{
+	FILE *f;
+	BPTR fh; // bulk reads, 0 = stdio
+	ULONG maxtransfer;
+	ULONG mask;
+	BOOL debug;
+	// async memory chunk reads, packets sent and replied in array order
+	struct MsgPort *port;
+	struct asyncpacket *packets;
+	ULONG npackets, sent, done, asyncsize;
+	struct DateStamp asyncstart;
+	BOOL asyncerror;
+	ULONG base; // stored zip entry offset
+	BOOL container; // read from kept ranges: gzip/zip, bundle or indexed
+	BOOL indexed; // plain file scanned, memory chunks read by uss_fetch()
+	// bundle: directory, page size, page index, last LZ4 page decompressed
+	UBYTE *dir;
+	ULONG entries;
+	ULONG pagesize;
+	ULONG pages;
+	ULONG *pageindex;
+	UBYTE *pagebuf;
+	ULONG pagefile;
+	// container: compressed stream
+	UBYTE *data;
+	ULONG datasize;
+	ULONG size; // decompressed size
+	ULONG pos;
+	UWORD attnflags;
+	// decode: stream position, current chunk header and its end
+	ULONG stream;
+	ULONG chunk;
+	ULONG chunkend;
+	ULONG keepend;
+	UBYTE head[12];
+	UBYTE *spool;
+	ULONG spoolsize, spoolalloc;
+	struct segment *segs;
+	ULONG nsegs, maxsegs;
+	struct fetch fetch[MEMORY_REGIONS];
+	UWORD nfetch;
+	// memory chunks held by the first decode, current one
+	struct fetch hold[MEMORY_REGIONS];
+	UWORD nhold;
+	struct fetch *held;
+	// container CRC-32: computed, from gzip trailer or zip directory
+	ULONG crc, crcfile;
+	BOOL error;
+};
+
+static ULONG getle16(UBYTE *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static ULONG getle32(UBYTE *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((ULONG)p[3] << 24);
+}
+
+static ULONG getbe32(UBYTE *p)
+{
+	return ((ULONG)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void putbe32(UBYTE *p, ULONG v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static void *growarray(void *p, ULONG *alloc, ULONG need, ULONG itemsize)
+{
+	ULONG n = *alloc ? *alloc : 16;
+	while (n < need)
+		n *= 2;
+	if (n == *alloc)
+		return p;
+	void *np = realloc(p, n * itemsize);
+	if (np)
+		*alloc = n;
+	return np;
+}
+
+// MaxTransfer and Mask of the file system device the file is on, from its
+// mount environment. No limit if unknown (RAM:, handlers without one).
+static void dos_transfer(BPTR fh, ULONG *maxp, ULONG *maskp)
+{
+	struct FileHandle *fhp = BADDR(fh);
+	struct DosInfo *di = BADDR(((struct RootNode*)DOSBase->dl_Root)->rn_Info);
+
+	*maxp = 0xffffffff;
+	*maskp = 0xffffffff;
+	Forbid();
+	for (struct DeviceNode *dn = BADDR(di->di_DevInfo); dn; dn = BADDR(dn->dn_Next)) {
+		if (dn->dn_Type != DLT_DEVICE || dn->dn_Task != fhp->fh_Type)
+			continue;
+		// startup can also be a small integer or a string
+		struct FileSysStartupMsg *fssm = BADDR(dn->dn_Startup);
+		if ((ULONG)dn->dn_Startup > 1024 && TypeOfMem(fssm)) {
+			struct DosEnvec *de = BADDR(fssm->fssm_Environ);
+			if (TypeOfMem(de) && de->de_TableSize >= DE_MASK)
+				*maskp = de->de_Mask;
+			if (TypeOfMem(de) && de->de_TableSize >= DE_MAXTRANSFER && de->de_MaxTransfer)
+				*maxp = de->de_MaxTransfer;
+		}
+		break;
+	}
+	Permit();
+}
+
+// device DMA can reach buf
+static BOOL dma_reachable(void *buf, ULONG size, ULONG mask)
+{
+	return !((ULONG)buf & ~mask) && (ULONG)buf + size - 1 <= (mask | 0xff);
+}
+
+// Read() straight to buf, some device drivers don't split transfers
+// larger than MaxTransfer themselves. If the device can't DMA to buf the
+// file system would read it block by block through its own buffers: bounce
+// through a reachable buffer instead.
+static BOOL dos_read(BPTR fh, ULONG maxtransfer, ULONG mask, ULONG offset, void *buf, ULONG size)
+{
+	UBYTE *bounce = NULL;
+	ULONG bsize = maxtransfer < BOUNCE_SIZE ? maxtransfer : BOUNCE_SIZE;
+	BOOL ok = TRUE;
+
+	if (!dma_reachable(buf, size, mask)) {
+		bounce = AllocMem(bsize, MEMF_ANY);
+		if (bounce && !dma_reachable(bounce, bsize, mask)) {
+			FreeMem(bounce, bsize);
+			bounce = AllocMem(bsize, MEMF_CHIP);
+		}
+		if (bounce)
+			maxtransfer = bsize;
+	}
+	// whole blocks: following pieces stay block aligned
+	if (maxtransfer >= 1024)
+		maxtransfer &= ~511;
+	if (Seek(fh, offset, OFFSET_BEGINNING) < 0)
+		ok = FALSE;
+	while (ok && size) {
+		ULONG n = size < maxtransfer ? size : maxtransfer;
+		ok = Read(fh, bounce ? bounce : buf, n) == n;
+		if (ok && bounce)
+			CopyMem(bounce, buf, n);
+		buf = (UBYTE*)buf + n;
+		size -= n;
+	}
+	if (bounce)
+		FreeMem(bounce, bsize);
+	return ok;
+}
+
+// bulk read from the state file, stdio if no dos handle
+static BOOL file_read(struct ussfile *uf, ULONG offset, void *buf, ULONG size)
+{
+	if (uf->fh)
+		return dos_read(uf->fh, uf->maxtransfer, uf->mask, offset, buf, size);
+	fseek(uf->f, offset, SEEK_SET);
+	return fread(buf, 1, size, uf->f) == size;
+}
+
+// keep decompressed bytes, merged with the previous range if contiguous
+static void spool_keep(struct ussfile *uf, ULONG offset, UBYTE *p, ULONG size)
+{
+	struct segment *sg = uf->nsegs ? &uf->segs[uf->nsegs - 1] : NULL;
+	UBYTE *spool = growarray(uf->spool, &uf->spoolalloc, uf->spoolsize + size, 1);
+	if (!spool) {
+		uf->error = TRUE;
+		return;
+	}
+	uf->spool = spool;
+	if (!sg || sg->file || sg->offset + sg->size != offset) {
+		struct segment *segs = growarray(uf->segs, &uf->maxsegs, uf->nsegs + 1, sizeof(struct segment));
+		if (!segs) {
+			uf->error = TRUE;
+			return;
+		}
+		uf->segs = segs;
+		sg = &segs[uf->nsegs++];
+		sg->offset = offset;
+		sg->size = 0;
+		sg->spool = uf->spoolsize;
+		sg->file = 0;
+	}
+	memcpy(uf->spool + uf->spoolsize, p, size);
+	uf->spoolsize += size;
+	sg->size += size;
+}
+
+// chunk header complete: find its end and how much of it is kept
+static void spool_chunk(struct ussfile *uf)
+{
+	ULONG size = getbe32(uf->head + 4);
+	ULONG datasize = size >= 12 ? size - 12 : 0;
+	ULONG start = uf->chunk + 12;
+	// what the parse passes read (chunk registry), nothing of unknown chunks
+	const struct chunktype *ct = find_chunktype(uf->head);
+	ULONG keep = 0;
+	if (ct && ct->kind != CHUNKTYPE_UNSUPPORTED)
+		keep = ct->maxsize && ct->maxsize < datasize ? ct->maxsize : datasize;
+	// delta state file memory chunks are read by load_chunk()
+	if (getbe32(uf->head + 8) & CHUNK_DELTA)
+		keep = datasize;
+	// data is followed by 1-4 bytes of padding
+	uf->chunkend = start + datasize + 4 - (datasize & 3);
+	uf->keepend = start + keep;
+}
+
+// Hold a whole memory chunk if RAM outside the memory bank targets (all
+// in the 24-bit address space) is plentiful, uss_fetch() copies from it.
+static void hold_chunk(struct ussfile *uf)
+{
+	const struct chunktype *ct = find_chunktype(uf->head);
+	ULONG size = uf->chunkend - uf->chunk;
+	uf->held = NULL;
+	if (!ct || ct->kind != CHUNKTYPE_MEMORY || (getbe32(uf->head + 8) & CHUNK_DELTA) || uf->nhold >= MEMORY_REGIONS)
+		return;
+	// room left for the chunk's own load buffer and the rest
+	if (AvailMem(MEMF_ANY | MEMF_LARGEST) < 2 * size + HOLD_RESERVE)
+		return;
+	UBYTE *b = AllocMem(size, MEMF_ANY);
+	if (!b)
+		return;
+	if ((ULONG)b < 0x01000000) {
+		FreeMem(b, size);
+		return;
+	}
+	uf->held = &uf->hold[uf->nhold++];
+	uf->held->offset = uf->chunk;
+	uf->held->size = size;
+	uf->held->dst = b;
+	memcpy(b, uf->head, 12);
+}
+
+static void hold_free(struct ussfile *uf)
+{
+	for (int i = 0; i < uf->nhold; i++)
+		FreeMem(uf->hold[i].dst, uf->hold[i].size);
+	uf->nhold = 0;
+	uf->held = NULL;
+}
+
+static void spool_chunks(struct ussfile *uf, UBYTE *p, ULONG size)
+{
+	while (size) {
+		ULONG s = uf->stream;
+		ULONG n = size;
+		if (s < uf->chunk + 12) {
+			if (n > uf->chunk + 12 - s)
+				n = uf->chunk + 12 - s;
+			memcpy(uf->head + s - uf->chunk, p, n);
+			spool_keep(uf, s, p, n);
+			if (s + n == uf->chunk + 12) {
+				spool_chunk(uf);
+				hold_chunk(uf);
+			}
+		} else {
+			if (n > uf->chunkend - s)
+				n = uf->chunkend - s;
+			if (s < uf->keepend)
+				spool_keep(uf, s, p, uf->keepend - s < n ? uf->keepend - s : n);
+			if (uf->held)
+				memcpy(uf->held->dst + s - uf->chunk, p, n);
+			if (s + n == uf->chunkend) {
+				uf->chunk = uf->chunkend;
+				uf->held = NULL;
+			}
+		}
+		uf->stream += n;
+		p += n;
+		size -= n;
+	}
+}
+
+static void fetch_chunks(struct ussfile *uf, UBYTE *p, ULONG size)
+{
+	ULONG s = uf->stream;
+	for (int i = 0; i < uf->nfetch; i++) {
+		struct fetch *fe = &uf->fetch[i];
+		ULONG start = fe->offset > s ? fe->offset : s;
+		ULONG end = fe->offset + fe->size < s + size ? fe->offset + fe->size : s + size;
+		if (start < end)
+			memcpy(fe->dst + start - fe->offset, p + start - s, end - start);
+	}
+	uf->stream += size;
+}
+
+static ULONG crc32(ULONG crc, UBYTE *p, ULONG size)
+{
+	static ULONG table[256];
+	if (!table[1]) {
+		for (ULONG i = 0; i < 256; i++) {
+			ULONG c = i;
+			for (int j = 0; j < 8; j++)
+				c = (c & 1) ? (c >> 1) ^ 0xedb88320 : c >> 1;
+			table[i] = c;
+		}
+	}
+	crc ^= 0xffffffff;
+	while (size--)
+		crc = table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+// inflate output sink (w_sink), called with staged output
+static ULONG container_sink(ULONG data, UBYTE *p, ULONG size)
+{
+	struct ussfile *uf = (struct ussfile*)data;
+	if (uf->nfetch) {
+		fetch_chunks(uf, p, size);
+	} else {
+		uf->crc = crc32(uf->crc, p, size);
+		spool_chunks(uf, p, size);
+	}
+	return data;
+}
+
+static BOOL container_decode(struct ussfile *uf)
+{
+	ULONG bufsize = VERIFY_WINDOW;
+	ULONG stacksize = INFLATE_STACK_SIZE + SINK_STACK_SIZE;
+	UBYTE *buf = AllocMem(bufsize, MEMF_ANY);
+	if (!buf) {
+		bufsize = STAGING_MIN;
+		buf = AllocMem(bufsize, MEMF_ANY);
+	}
+	UBYTE *stack = AllocMem(stacksize, MEMF_ANY);
+	if (!buf || !stack) {
+		printf("ERROR: Not enough memory for decompression.\n");
+		if (buf)
+			FreeMem(buf, bufsize);
+		if (stack)
+			FreeMem(stack, stacksize);
+		return FALSE;
+	}
+	// no static table cache: the sink runs on the inflate stack
+	struct inflatecontext ic = { 0 };
+	ic.buf = ic.flushed = buf;
+	ic.limit = buf + bufsize - 258;
+	ic.sink = container_sink;
+	ic.sinkdata = (ULONG)uf;
+	ic.burst = BURST_RAM(buf);
+	uf->stream = 0;
+	uf->chunk = 0;
+	uf->crc = 0;
+	if (uf->attnflags & AFF_68020)
+		callinflate(buf, uf->data, uf->attnflags, stack + stacksize, &ic);
+	else
+		callinflatecode(buf, uf->data, inflatewin, stack + stacksize, &ic);
+	FreeMem(stack, stacksize);
+	FreeMem(buf, bufsize);
+	if (uf->stream != uf->size || uf->error) {
+		printf("ERROR: Container decompression failed (%lu of %lu bytes).\n", uf->stream, uf->size);
+		return FALSE;
+	}
+	if (!uf->nfetch && uf->crc != uf->crcfile) {
+		printf("ERROR: Container CRC mismatch (%08lx, expected %08lx).\n", uf->crc, uf->crcfile);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static BOOL container_load(struct ussfile *uf, ULONG offset, ULONG size)
+{
+	// inflate may read a few bytes past the end of the stream
+	uf->container = TRUE;
+	uf->datasize = size + 8;
+	uf->data = AllocMem(uf->datasize, MEMF_ANY | MEMF_CLEAR);
+	if (!uf->data) {
+		printf("ERROR: Not enough memory for compressed state file (%lu bytes).\n", size);
+		return FALSE;
+	}
+	if (!file_read(uf, offset, uf->data, size)) {
+		printf("ERROR: Read error (%lu bytes).\n", size);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void container_free(struct ussfile *uf)
+{
+	if (uf->data)
+		FreeMem(uf->data, uf->datasize);
+	uf->data = NULL;
+	hold_free(uf);
+}
+
+// Plain state file: keep chunk headers and what spool_chunk() keeps, seek
+// forward over the rest. Falls back to direct file reads if out of memory.
+static void scan_chunks(struct ussfile *uf, struct uaestate *st)
+{
+	UBYTE skip[SCAN_SKIP];
+	ULONG pos = 0, chunks = 0;
+
+	fseek(uf->f, uf->base, SEEK_SET);
+	while (pos < uf->size && !uf->error) {
+		// END chunk can be only 8 bytes
+		ULONG n = fread(uf->head, 1, pos + 12 <= uf->size ? 12 : uf->size - pos, uf->f);
+		spool_keep(uf, pos, uf->head, n);
+		if (n < 12)
+			break;
+		uf->chunk = pos;
+		spool_chunk(uf);
+		chunks++;
+		ULONG keep = uf->keepend - (pos + 12);
+		if (keep) {
+			UBYTE *b = malloc(keep);
+			if (!b || fread(b, 1, keep, uf->f) != keep) {
+				uf->error = b == NULL;
+				free(b);
+				break;
+			}
+			spool_keep(uf, pos + 12, b, keep);
+			free(b);
+		}
+		if (!memcmp(uf->head, "END ", 4))
+			break;
+		ULONG gap = uf->chunkend - uf->keepend;
+		if (gap > SCAN_SKIP)
+			fseek(uf->f, uf->base + uf->chunkend, SEEK_SET);
+		else
+			fread(skip, 1, gap, uf->f);
+		pos = uf->chunkend;
+	}
+	if (uf->error) {
+		// unindexed: parse passes read the file
+		free(uf->spool);
+		free(uf->segs);
+		uf->spool = NULL;
+		uf->segs = NULL;
+		uf->spoolsize = uf->spoolalloc = 0;
+		uf->nsegs = uf->maxsegs = 0;
+		uf->error = FALSE;
+		return;
+	}
+	uf->container = TRUE;
+	uf->indexed = TRUE;
+	if (st->debug)
+		printf("State file indexed, %lu chunks, %lu bytes kept in %lu ranges.\n", chunks, uf->spoolsize, uf->nsegs);
+}
+
+static void print_read(const char *what, ULONG total, struct DateStamp *ds1)
+{
+	struct DateStamp ds2;
+	DateStamp(&ds2);
+	LONG ticks = ((ds2.ds_Days - ds1->ds_Days) * 24 * 60 + ds2.ds_Minute - ds1->ds_Minute) * 60 * TICKS_PER_SECOND + ds2.ds_Tick - ds1->ds_Tick;
+	if (ticks <= 0)
+		ticks = 1;
+	printf("Memory chunks %s: %luk in %lu.%02lus, %lu kB/s.\n", what, total >> 10,
+		ticks / TICKS_PER_SECOND, (ticks % TICKS_PER_SECOND) * (100 / TICKS_PER_SECOND),
+		(total >> 10) * TICKS_PER_SECOND / ticks);
+}
+
+// queued memory chunk reads in file order
+static BOOL fetch_file(struct ussfile *uf)
+{
+	struct DateStamp ds1;
+	ULONG total = 0;
+
+	DateStamp(&ds1);
+	for (int i = 0; i < uf->nfetch; i++) {
+		struct fetch *fe = &uf->fetch[i];
+		if (!file_read(uf, uf->base + fe->offset, fe->dst, fe->size))
+			return FALSE;
+		total += fe->size;
+	}
+	if (uf->debug)
+		print_read("read", total, &ds1);
+	return TRUE;
+}
+
+static void async_packet(struct ussfile *uf, struct asyncpacket *ap, LONG type, LONG arg2, LONG arg3, UBYTE *dst)
+{
+	struct FileHandle *fhp = BADDR(uf->fh);
+	ap->sp.sp_Msg.mn_Node.ln_Name = (char*)&ap->sp.sp_Pkt;
+	ap->sp.sp_Pkt.dp_Link = &ap->sp.sp_Msg;
+	ap->sp.sp_Pkt.dp_Port = uf->port;
+	ap->sp.sp_Pkt.dp_Type = type;
+	ap->sp.sp_Pkt.dp_Arg1 = fhp->fh_Arg1;
+	ap->sp.sp_Pkt.dp_Arg2 = arg2;
+	ap->sp.sp_Pkt.dp_Arg3 = arg3;
+	ap->dst = dst;
+}
+
+static void async_send(struct ussfile *uf)
+{
+	struct FileHandle *fhp = BADDR(uf->fh);
+	struct asyncpacket *ap = &uf->packets[uf->sent++];
+	// same as SendPkt(), also on KS 1.x
+	PutMsg(fhp->fh_Type, &ap->sp.sp_Msg);
+}
+
+// Collect the reply of the packet in flight and send the next one. A seek
+// that failed (Res1 -1, error in Res2) or a short read ends the chain: the
+// reads after it are never sent.
+static void async_poll(struct ussfile *uf)
+{
+	struct Message *msg;
+	while ((msg = GetMsg(uf->port))) {
+		struct DosPacket *dp = &((struct asyncpacket*)msg)->sp.sp_Pkt;
+		BOOL seek = dp->dp_Type == ACTION_SEEK;
+		uf->done++;
+		if (seek ? dp->dp_Res1 < 0 : dp->dp_Res1 != dp->dp_Arg3) {
+			if (uf->debug)
+				printf("Memory chunks: %s failed (%ld, error %ld).\n", seek ? "seek" : "read", dp->dp_Res1, dp->dp_Res2);
+			uf->asyncerror = TRUE;
+		}
+		if (!uf->asyncerror && uf->sent < uf->npackets)
+			async_send(uf);
+	}
+}
+
+static void async_free(struct ussfile *uf)
+{
+	if (uf->packets)
+		FreeMem(uf->packets, uf->npackets * sizeof(struct asyncpacket));
+	if (uf->port) {
+		FreeSignal(uf->port->mp_SigBit);
+		FreeMem(uf->port, sizeof(struct MsgPort));
+	}
+	uf->packets = NULL;
+	uf->port = NULL;
+}
+
+// Queue all memory chunk reads, a seek and MaxTransfer sized reads each,
+// and send the first seek. FALSE if not possible: no dos handle, out of memory or destination that
+// needs a bounce buffer.
+static BOOL fetch_async(struct ussfile *uf)
+{
+	ULONG piece = uf->maxtransfer < ASYNC_PIECE ? uf->maxtransfer : ASYNC_PIECE;
+	ULONG n = 0;
+
+	if (!uf->fh)
+		return FALSE;
+	if (piece >= 1024)
+		piece &= ~511;
+	for (int i = 0; i < uf->nfetch; i++) {
+		struct fetch *fe = &uf->fetch[i];
+		if (!dma_reachable(fe->dst, fe->size, uf->mask))
+			return FALSE;
+		n += 1 + (fe->size + piece - 1) / piece;
+	}
+	uf->port = AllocMem(sizeof(struct MsgPort), MEMF_PUBLIC | MEMF_CLEAR);
+	uf->packets = AllocMem(n * sizeof(struct asyncpacket), MEMF_PUBLIC | MEMF_CLEAR);
+	uf->npackets = n;
+	BYTE sigbit = uf->port ? AllocSignal(-1) : -1;
+	if (!uf->packets || sigbit < 0) {
+		if (sigbit >= 0)
+			FreeSignal(sigbit);
+		if (uf->port)
+			FreeMem(uf->port, sizeof(struct MsgPort));
+		uf->port = NULL;
+		async_free(uf);
+		return FALSE;
+	}
+	struct MsgPort *mp = uf->port;
+	mp->mp_Node.ln_Type = NT_MSGPORT;
+	mp->mp_Flags = PA_SIGNAL;
+	mp->mp_SigBit = sigbit;
+	mp->mp_SigTask = FindTask(NULL);
+	mp->mp_MsgList.lh_Head = (struct Node*)&mp->mp_MsgList.lh_Tail;
+	mp->mp_MsgList.lh_TailPred = (struct Node*)&mp->mp_MsgList.lh_Head;
+
+	struct asyncpacket *ap = uf->packets;
+	uf->sent = uf->done = 0;
+	uf->asyncsize = 0;
+	uf->asyncerror = FALSE;
+	DateStamp(&uf->asyncstart);
+	for (int i = 0; i < uf->nfetch; i++) {
+		struct fetch *fe = &uf->fetch[i];
+		async_packet(uf, ap++, ACTION_SEEK, uf->base + fe->offset, OFFSET_BEGINNING, fe->dst);
+		for (ULONG pos = 0; pos < fe->size; pos += piece) {
+			ULONG len = fe->size - pos < piece ? fe->size - pos : piece;
+			async_packet(uf, ap++, ACTION_READ, (LONG)(fe->dst + pos), len, fe->dst);
+		}
+		uf->asyncsize += fe->size;
+	}
+	async_send(uf);
+	if (uf->debug)
+		printf("Memory chunks: %lu packets queued.\n", n);
+	return TRUE;
+}
+
+// queued memory chunk reads in file order, asynchronous if possible
+static BOOL fetch_indexed(struct ussfile *uf)
+{
+	for (int i = 1; i < uf->nfetch; i++) {
+		for (int j = i; j > 0 && uf->fetch[j].offset < uf->fetch[j - 1].offset; j--) {
+			struct fetch t = uf->fetch[j];
+			uf->fetch[j] = uf->fetch[j - 1];
+			uf->fetch[j - 1] = t;
+		}
+	}
+	return fetch_async(uf) || fetch_file(uf);
+}
+
+// gzip (RFC 1952): deflate stream after a variable length header
+static BOOL open_gzip(struct ussfile *uf, ULONG filesize)
+{
+	UBYTE h[10], t[8];
+	ULONG pos = 10;
+
+	fseek(uf->f, 0, SEEK_SET);
+	if (fread(h, 1, 10, uf->f) != 10 || h[2] != 8) {
+		printf("ERROR: Unsupported gzip compression method.\n");
+		return FALSE;
+	}
+	if (h[3] & 4) {
+		// FEXTRA
+		if (fread(t, 1, 2, uf->f) != 2)
+			return FALSE;
+		pos += 2 + getle16(t);
+		fseek(uf->f, pos, SEEK_SET);
+	}
+	for (int flag = 8; flag <= 16; flag <<= 1) {
+		// FNAME, FCOMMENT: zero terminated
+		if (h[3] & flag) {
+			int c;
+			while ((c = fgetc(uf->f)) > 0)
+				pos++;
+			pos++;
+		}
+	}
+	if (h[3] & 2)
+		pos += 2; // FHCRC
+	if (pos + 8 > filesize)
+		return FALSE;
+	// trailer: CRC-32, decompressed size
+	fseek(uf->f, filesize - 8, SEEK_SET);
+	if (fread(t, 1, 8, uf->f) != 8)
+		return FALSE;
+	uf->crcfile = getle32(t);
+	uf->size = getle32(t + 4);
+	return container_load(uf, pos, filesize - 8 - pos);
+}
+
+// zip: first .uss entry, or first file entry, from the central directory
+static BOOL open_zip(struct ussfile *uf, ULONG filesize)
+{
+	ULONG tailsize = filesize < ZIP_EOCD_MAX ? filesize : ZIP_EOCD_MAX;
+	UBYTE *tail = malloc(tailsize);
+	UBYTE *cd = NULL, *e = NULL;
+	ULONG cdsize = 0, entries = 0, cdoffset = 0;
+	UBYTE lh[30];
+	BOOL ok = FALSE;
+
+	if (!tail)
+		return FALSE;
+	fseek(uf->f, filesize - tailsize, SEEK_SET);
+	if (fread(tail, 1, tailsize, uf->f) == tailsize) {
+		for (LONG i = tailsize - ZIP_EOCD; i >= 0; i--) {
+			if (tail[i] == 'P' && tail[i + 1] == 'K' && tail[i + 2] == 5 && tail[i + 3] == 6) {
+				entries = getle16(tail + i + 10);
+				cdsize = getle32(tail + i + 12);
+				cdoffset = getle32(tail + i + 16);
+				break;
+			}
+		}
+	}
+	free(tail);
+	if (entries && cdoffset + cdsize <= filesize)
+		cd = malloc(cdsize);
+	if (!cd) {
+		printf("ERROR: Zip central directory not found.\n");
+		return FALSE;
+	}
+	fseek(uf->f, cdoffset, SEEK_SET);
+	if (fread(cd, 1, cdsize, uf->f) == cdsize) {
+		UBYTE *p = cd;
+		for (ULONG i = 0; i < entries && p + 46 <= cd + cdsize; i++) {
+			ULONG namelen = getle16(p + 28);
+			if (getle32(p) != 0x02014b50 || p + 46 + namelen > cd + cdsize)
+				break;
+			if (getle32(p + 24)) {
+				if (!e)
+					e = p;
+				if (namelen >= 4 && !strnicmp((char*)p + 46 + namelen - 4, ".uss", 4)) {
+					e = p;
+					break;
+				}
+			}
+			p += 46 + namelen + getle16(p + 30) + getle16(p + 32);
+		}
+	}
+	if (!e) {
+		printf("ERROR: No state file in zip archive.\n");
+	} else {
+		ULONG method = getle16(e + 10);
+		ULONG csize = getle32(e + 20);
+		ULONG offset = getle32(e + 42);
+		// stored entry is not read as a whole, its CRC is not checked
+		uf->crcfile = getle32(e + 16);
+		uf->size = getle32(e + 24);
+		fseek(uf->f, offset, SEEK_SET);
+		if (fread(lh, 1, 30, uf->f) == 30 && getle32(lh) == 0x04034b50) {
+			offset += 30 + getle16(lh + 26) + getle16(lh + 28);
+			if (method == 0) {
+				uf->base = offset;
+				ok = TRUE;
+			} else if (method == 8) {
+				ok = container_load(uf, offset, csize);
+			} else {
+				printf("ERROR: Unsupported zip compression method %lu.\n", method);
+			}
+		}
+	}
+	free(cd);
+	return ok;
+}
+
+// bundle page, merged with the previous one if it follows it in the file
+static void bundle_page(struct ussfile *uf, ULONG offset, ULONG size, ULONG file, ULONG packed)
+{
+	struct segment *sg = uf->nsegs ? &uf->segs[uf->nsegs - 1] : NULL;
+	if (sg && sg->file && !sg->packed && !packed && sg->offset + sg->size == offset) {
+		if (file == BUNDLE_ZERO ? sg->file == BUNDLE_ZERO : sg->file != BUNDLE_ZERO && sg->file + sg->size == file) {
+			sg->size += size;
+			return;
+		}
+	}
+	struct segment *segs = growarray(uf->segs, &uf->maxsegs, uf->nsegs + 1, sizeof(struct segment));
+	if (!segs) {
+		uf->error = TRUE;
+		return;
+	}
+	uf->segs = segs;
+	sg = &segs[uf->nsegs++];
+	sg->offset = offset;
+	sg->size = size;
+	sg->spool = 0;
+	sg->file = file;
+	sg->packed = packed;
+}
+
+// LZ4 bundle page, decompressed once to the page buffer
+static BOOL bundle_unpack(struct ussfile *uf, struct segment *sg, ULONG offset, UBYTE *dst, ULONG size)
+{
+	if (uf->pagefile != sg->file) {
+		if (!uf->pagebuf && !(uf->pagebuf = malloc(2 * uf->pagesize)))
+			return FALSE;
+		UBYTE *src = uf->pagebuf + uf->pagesize;
+		uf->pagefile = 0;
+		if (!file_read(uf, sg->file, src, sg->packed))
+			return FALSE;
+		unlz4(uf->pagebuf, src, uf->pagebuf + uf->pagesize);
+		uf->pagefile = sg->file;
+	}
+	memcpy(dst, uf->pagebuf + offset, size);
+	return TRUE;
+}
+
+static UBYTE *bundle_find(struct ussfile *uf, const char *name, ULONG type)
+{
+	for (ULONG i = 0; i < uf->entries; i++) {
+		UBYTE *e = uf->dir + i * BUNDLE_ENTRY;
+		if (getbe32(e + BUNDLE_NAME) == type && !strnicmp((char*)e, name, BUNDLE_NAME))
+			return e;
+	}
+	return NULL;
+}
+
+// memory chunk as uncompressed chunk, its pages from bundle page data
+static void bundle_memory(struct ussfile *uf, UBYTE *p, ULONG datasize)
+{
+	static const UBYTE pad[4];
+	ULONG size = datasize >= 4 ? getbe32(p + 12) : 0;
+	ULONG pages = (size + uf->pagesize - 1) / uf->pagesize;
+	UBYTE head[12];
+
+	if (datasize < 4 + pages * 4) {
+		uf->error = TRUE;
+		return;
+	}
+	memcpy(head, p, 4);
+	putbe32(head + 4, size + 12);
+	putbe32(head + 8, 0);
+	spool_keep(uf, uf->size, head, 12);
+	uf->size += 12;
+	for (ULONG i = 0; i < pages; i++) {
+		ULONG n = size - i * uf->pagesize < uf->pagesize ? size - i * uf->pagesize : uf->pagesize;
+		ULONG page = getbe32(p + 16 + i * 4);
+		ULONG file = BUNDLE_ZERO, packed = 0;
+		if (page != BUNDLE_ZERO) {
+			if (page >= uf->pages) {
+				uf->error = TRUE;
+				return;
+			}
+			file = uf->pageindex[page];
+			packed = uf->pageindex[page + 1] - file;
+			if (packed == uf->pagesize)
+				packed = 0;
+		}
+		bundle_page(uf, uf->size, n, file, packed);
+		uf->size += n;
+	}
+	spool_keep(uf, uf->size, (UBYTE*)pad, 4 - (size & 3));
+	uf->size += 4 - (size & 3);
+}
+
+// bundle (usspack -b): directory, then state by name
+static BOOL open_bundle(struct ussfile *uf, const char *state, ULONG filesize)
+{
+	UBYTE h[BUNDLE_HEAD];
+
+	fseek(uf->f, 0, SEEK_SET);
+	if (fread(h, 1, BUNDLE_HEAD, uf->f) != BUNDLE_HEAD)
+		return FALSE;
+	uf->entries = getbe32(h + 4);
+	uf->pagesize = getbe32(h + 8);
+	ULONG index = getbe32(h + 12);
+	ULONG dirsize = uf->entries * BUNDLE_ENTRY;
+	if (!uf->pagesize || uf->pagesize > 65536 || index > filesize - 4 || dirsize > filesize)
+		return FALSE;
+	uf->dir = malloc(dirsize + 1);
+	if (!uf->dir || fread(uf->dir, 1, dirsize, uf->f) != dirsize)
+		return FALSE;
+	// page index: offsets in order, pages no longer than the page size
+	fseek(uf->f, index, SEEK_SET);
+	if (fread(h, 1, 4, uf->f) != 4)
+		return FALSE;
+	uf->pages = getbe32(h);
+	if (uf->pages > (filesize - index) / 4 - 2)
+		return FALSE;
+	uf->pageindex = malloc((uf->pages + 1) * sizeof(ULONG));
+	UBYTE *raw = (UBYTE*)uf->pageindex;
+	if (!raw || fread(raw, 4, uf->pages + 1, uf->f) != uf->pages + 1)
+		return FALSE;
+	// big endian longwords to ULONG in place, from the end
+	for (ULONG i = uf->pages + 1; i-- > 0; )
+		uf->pageindex[i] = getbe32(raw + i * 4);
+	for (ULONG i = 0; i <= uf->pages; i++) {
+		if (uf->pageindex[i] > filesize || (i && (uf->pageindex[i] <= uf->pageindex[i - 1] || uf->pageindex[i] - uf->pageindex[i - 1] > uf->pagesize)))
+			return FALSE;
+	}
+	UBYTE *e = bundle_find(uf, state, BUNDLE_STATE);
+	if (!e) {
+		printf("ERROR: State '%s' not found in bundle. States:", state);
+		for (ULONG i = 0; i < uf->entries; i++) {
+			UBYTE *e = uf->dir + i * BUNDLE_ENTRY;
+			if (getbe32(e + BUNDLE_NAME) == BUNDLE_STATE)
+				printf(" %.36s", e);
+		}
+		printf("\n");
+		return FALSE;
+	}
+	ULONG offset = getbe32(e + 40);
+	ULONG tocsize = getbe32(e + 44);
+	UBYTE *toc = tocsize <= filesize ? malloc(tocsize + 1) : NULL;
+	if (!toc)
+		return FALSE;
+	fseek(uf->f, offset, SEEK_SET);
+	if (fread(toc, 1, tocsize, uf->f) != tocsize) {
+		free(toc);
+		return FALSE;
+	}
+	uf->container = TRUE;
+	uf->size = 0;
+	ULONG pos = 0;
+	while (pos + 12 <= tocsize && !uf->error) {
+		UBYTE *p = toc + pos;
+		ULONG size = getbe32(p + 4);
+		ULONG datasize = size >= 12 ? size - 12 : 0;
+		ULONG total = 12 + datasize + 4 - (datasize & 3);
+		if (!memcmp(p, "END ", 4) || pos + total > tocsize)
+			break;
+		if (getbe32(p + 8) & CHUNK_PAGES)
+			bundle_memory(uf, p, datasize);
+		else {
+			spool_keep(uf, uf->size, p, total);
+			uf->size += total;
+		}
+		pos += total;
+	}
+	// END chunk and anything after it
+	if (pos < tocsize) {
+		spool_keep(uf, uf->size, toc + pos, tocsize - pos);
+		uf->size += tocsize - pos;
+	}
+	free(toc);
+	if (uf->error)
+		printf("ERROR: Bundle state '%s' is corrupt.\n", state);
+	return !uf->error;
+}
+
+// Native state file: small chunks, memory chunk headers and their first
+// bytes are kept from one read, memory chunks are fetched from the stream.
+static BOOL open_native(struct ussfile *uf, ULONG filesize)
+{
+	UBYTE h[NATIVE_HEAD];
+	if (fread(h, 1, NATIVE_HEAD, uf->f) != NATIVE_HEAD)
+		return FALSE;
+	ULONG base = getbe32(h + 4), entries = getbe32(h + 8), region = getbe32(h + 12);
+	if (base != NATIVE_HEAD + entries * NATIVE_ENTRY || base > filesize || region > filesize - base) {
+		printf("ERROR: Native state file is corrupt.\n");
+		return FALSE;
+	}
+	ULONG size = base - NATIVE_HEAD + region;
+	UBYTE *b = malloc(size);
+	if (!b || !file_read(uf, NATIVE_HEAD, b, size)) {
+		printf("ERROR: Read error (%lu bytes).\n", size);
+		free(b);
+		return FALSE;
+	}
+	spool_keep(uf, 0, b + base - NATIVE_HEAD, region);
+	for (ULONG i = 0; i < entries; i++) {
+		UBYTE *e = b + i * NATIVE_ENTRY;
+		ULONG offset = getbe32(e + 12);
+		ULONG datasize = getbe32(e + 4) >= 12 ? getbe32(e + 4) - 12 : 0;
+		if (offset < region)
+			continue;
+		spool_keep(uf, offset, e, 12);
+		spool_keep(uf, offset + 12, e + 16, datasize < NATIVE_PREFIX ? datasize : NATIVE_PREFIX);
+	}
+	free(b);
+	uf->base = base;
+	uf->size = filesize - base;
+	uf->container = TRUE;
+	uf->indexed = TRUE;
+	return !uf->error;
+}
+
+struct ussfile *uss_open(const char *name, struct uaestate *st)
+{
+	struct ussfile *uf = calloc(sizeof(struct ussfile), 1);
+	UBYTE id[4] = { 0 };
+	UBYTE path[256];
+	if (!uf)
+		return NULL;
+	uf->attnflags = st->attnflags;
+	uf->f = fopen(name, "rb");
+	// bundle:statename
+	const char *state = NULL;
+	const char *sep = strrchr(name, ':');
+	if (!uf->f && sep && sep[1] && sep - name < sizeof path) {
+		memcpy(path, name, sep - name);
+		path[sep - name] = 0;
+		state = sep + 1;
+		uf->f = fopen(path, "rb");
+	}
+	if (!uf->f) {
+		printf("Couldn't open '%s'\n", name);
+		free(uf);
+		return NULL;
+	}
+	uf->debug = st->debug;
+	uf->fh = Open(state ? (STRPTR)path : (STRPTR)name, MODE_OLDFILE);
+	if (uf->fh) {
+		dos_transfer(uf->fh, &uf->maxtransfer, &uf->mask);
+		if (st->debug)
+			printf("MaxTransfer %08lx, Mask %08lx.\n", uf->maxtransfer, uf->mask);
+	}
+	fseek(uf->f, 0, SEEK_END);
+	ULONG filesize = ftell(uf->f);
+	fseek(uf->f, 0, SEEK_SET);
+	fread(id, 1, 4, uf->f);
+	fseek(uf->f, 0, SEEK_SET);
+	BOOL ok = TRUE;
+	if (!memcmp(id, "USSB", 4)) {
+		ok = open_bundle(uf, state ? state : "", filesize);
+		if (ok && st->debug)
+			printf("Bundle state '%s', %lu bytes in %lu ranges.\n", state, uf->size, uf->nsegs);
+	} else if (state) {
+		printf("Couldn't open '%s'\n", name);
+		ok = FALSE;
+	} else if (!memcmp(id, "USSN", 4)) {
+		ok = open_native(uf, filesize);
+		if (ok && st->debug)
+			printf("Native state file, %lu bytes kept in %lu ranges.\n", uf->spoolsize, uf->nsegs);
+	} else if (id[0] == 0x1f && id[1] == 0x8b) {
+		ok = open_gzip(uf, filesize);
+		if (ok && st->debug)
+			printf("gzip container, %lu bytes.\n", uf->size);
+	} else if (id[0] == 'P' && id[1] == 'K' && id[2] == 3 && id[3] == 4) {
+		ok = open_zip(uf, filesize);
+		if (ok && st->debug)
+			printf("zip container, %lu bytes%s.\n", uf->size, uf->data ? "" : ", stored");
+	}
+	if (ok && uf->data) {
+		ok = container_decode(uf);
+		if (ok && st->debug)
+			printf("Decompressed, %lu bytes kept in %lu ranges.\n", uf->spoolsize, uf->nsegs);
+	} else if (ok && !uf->container) {
+		// plain state file or stored zip entry
+		if (!uf->base)
+			uf->size = filesize;
+		scan_chunks(uf, st);
+	}
+	if (!ok) {
+		uss_close(uf);
+		return NULL;
+	}
+	uss_seek(uf, 0, SEEK_SET);
+	return uf;
+}
+
+void uss_close(struct ussfile *uf)
+{
+	// packets must be back before the handle and buffers go away
+	uss_wait(uf, NULL);
+	if (uf->fh)
+		Close(uf->fh);
+	container_free(uf);
+	free(uf->spool);
+	free(uf->segs);
+	free(uf->dir);
+	free(uf->pageindex);
+	free(uf->pagebuf);
+	fclose(uf->f);
+	free(uf);
+}
+
+ULONG uss_read(struct ussfile *uf, void *buf, ULONG size)
+{
+	// keep async memory chunk reads going during pass 2
+	if (uf->packets)
+		async_poll(uf);
+	if (!uf->container) {
+		// stored zip entry ends at its size
+		ULONG pos = uss_tell(uf);
+		if (uf->base && size > uf->size - pos)
+			size = pos < uf->size ? uf->size - pos : 0;
+		return fread(buf, 1, size, uf->f);
+	}
+	// kept ranges only
+	ULONG done = 0;
+	for (ULONG i = 0; i < uf->nsegs && done < size; i++) {
+		struct segment *sg = &uf->segs[i];
+		if (uf->pos < sg->offset || uf->pos >= sg->offset + sg->size)
+			continue;
+		ULONG n = sg->offset + sg->size - uf->pos;
+		if (n > size - done)
+			n = size - done;
+		if (!sg->file) {
+			memcpy((UBYTE*)buf + done, uf->spool + sg->spool + uf->pos - sg->offset, n);
+		} else if (sg->file == BUNDLE_ZERO) {
+			memset((UBYTE*)buf + done, 0, n);
+		} else if (sg->packed) {
+			if (!bundle_unpack(uf, sg, uf->pos - sg->offset, (UBYTE*)buf + done, n))
+				break;
+		} else if (!file_read(uf, sg->file + uf->pos - sg->offset, (UBYTE*)buf + done, n)) {
+			break;
+		}
+		uf->pos += n;
+		done += n;
+	}
+	return done;
+}
+
+void uss_seek(struct ussfile *uf, LONG offset, int whence)
+{
+	if (!uf->container)
+		fseek(uf->f, whence == SEEK_SET ? offset + uf->base : offset, whence);
+	else
+		uf->pos = whence == SEEK_SET ? offset : uf->pos + offset;
+}
+
+ULONG uss_tell(struct ussfile *uf)
+{
+	if (!uf->container)
+		return ftell(uf->f) - uf->base;
+	return uf->pos;
+}
+
+// read now or, from a compressed container or indexed file, when uss_fetch()
+// decompresses or reads it
+BOOL uss_load(struct ussfile *uf, ULONG offset, void *buf, ULONG size)
+{
+	if (!uf->data && !uf->indexed) {
+		ULONG oldoffset = uss_tell(uf);
+		uss_seek(uf, offset, SEEK_SET);
+		ULONG n = uss_read(uf, buf, size);
+		uss_seek(uf, oldoffset, SEEK_SET);
+		return n == size;
+	}
+	if (uf->nfetch >= MEMORY_REGIONS || offset + size > uf->size)
+		return FALSE;
+	struct fetch *fe = &uf->fetch[uf->nfetch++];
+	fe->offset = offset;
+	fe->size = size;
+	fe->dst = buf;
+	return TRUE;
+}
+
+// queued reads from memory chunks held by the first decode
+static void fetch_held(struct ussfile *uf)
+{
+	UWORD n = 0;
+	for (int i = 0; i < uf->nfetch; i++) {
+		struct fetch *fe = &uf->fetch[i];
+		int j;
+		for (j = 0; j < uf->nhold; j++) {
+			struct fetch *h = &uf->hold[j];
+			if (fe->offset >= h->offset && fe->offset + fe->size <= h->offset + h->size)
+				break;
+		}
+		if (j < uf->nhold) {
+			CopyMem(uf->hold[j].dst + fe->offset - uf->hold[j].offset, fe->dst, fe->size);
+			if (uf->debug)
+				printf("Memory chunk at %lu: held by first decode.\n", fe->offset);
+		} else {
+			uf->fetch[n++] = *fe;
+		}
+	}
+	uf->nfetch = n;
+}
+
+// decompress or read queued reads, compressed container is not needed afterwards
+BOOL uss_fetch(struct ussfile *uf)
+{
+	BOOL ok = TRUE;
+	if (uf->nhold)
+		fetch_held(uf);
+	if (uf->nfetch && uf->data)
+		ok = container_decode(uf);
+	else if (uf->nfetch && uf->indexed)
+		ok = fetch_indexed(uf);
+	uf->nfetch = 0;
+	container_free(uf);
+	return ok;
+}
+
+// Collect finished async reads and send the next one. Only one packet is
+// in flight: the chain only advances when the caller polls (or reads or
+// waits), never while the CPU is busy in one long decompression.
+void uss_poll(struct ussfile *uf)
+{
+	if (uf && uf->packets)
+		async_poll(uf);
+}
+
+// Wait until async reads to dst (NULL = all) are done. FALSE if a read
+// has failed. Nothing to wait for if the reads were not asynchronous.
+BOOL uss_wait(struct ussfile *uf, void *dst)
+{
+	if (!uf)
+		return TRUE;
+	if (!uf->packets)
+		return !uf->asyncerror;
+	// packets complete in order: wait for the last one of dst
+	ULONG last = 0;
+	for (ULONG i = 0; i < uf->npackets; i++) {
+		if (!dst || uf->packets[i].dst == dst)
+			last = i + 1;
+	}
+	async_poll(uf);
+	while (uf->done < last && uf->sent > uf->done) {
+		WaitPort(uf->port);
+		async_poll(uf);
+	}
+	// all back or chain ended by an error
+	if (uf->sent == uf->done && (uf->done == uf->npackets || uf->asyncerror)) {
+		if (uf->debug && !uf->asyncerror)
+			print_read("read (overlapped)", uf->asyncsize, &uf->asyncstart);
+		async_free(uf);
+	}
+	return !uf->asyncerror;
+}
+
+// bundle Kickstart image size, read to buf if not NULL. 0 = not found.
+ULONG uss_rom(struct ussfile *uf, const char *name, void *buf)
+{
+	UBYTE *e = uf->dir ? bundle_find(uf, name, BUNDLE_ROM) : NULL;
+	if (!e)
+		return 0;
+	ULONG size = getbe32(e + 44);
+	if (buf && !file_read(uf, getbe32(e + 40), buf, size))
+		return 0;
+	return size;
+}
+
+// whole file (ROM image) with bulk reads
+BOOL uss_readfile(const char *name, void *buf, ULONG size)
+{
+	BPTR fh = Open((STRPTR)name, MODE_OLDFILE);
+	if (!fh)
+		return FALSE;
+	ULONG maxtransfer, mask;
+	dos_transfer(fh, &maxtransfer, &mask);
+	BOOL ok = dos_read(fh, maxtransfer, mask, 0, buf, size);
+	Close(fh);
+	return ok;
+}
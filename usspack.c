@@ -0,0 +1,1365 @@
+/*
+ * usspack: recompress UAE state file memory chunks for ussload.
+ *
+ * Linux/host tool, build with "make usspack" (needs zlib).
+ *
+ * Chip, "Slow" and Fast RAM chunks (CRAM, BRAM, FRAM) are recompressed,
+ * all other chunks are copied unchanged. Default codec is LZ4, which
+ * ussload decompresses many times faster than zlib (see unlz4.S).
+ * Files written with LZ4 chunks can only be loaded by ussload.
+ * The fast zlib mode (deflate.c) writes standard zlib that any version
+ * can load, with a parse that decompresses faster on the 68000.
+ * Delta mode (-d) writes a state file that only has the memory pages that
+ * differ from a base state file. Bundle mode (-b) writes many state files
+ * to one file that has each distinct memory page only once. Native mode
+ * (-N) writes a state file laid out for ussload's reads.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#include "usspack.h"
+
+static ULONG getlong(const UBYTE *p)
+{
+	return ((ULONG)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | (p[3] << 0);
+}
+static void putlong(UBYTE *p, ULONG v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v >> 0;
+}
+
+// LZ4 block format limits
+#define LZ4_MINMATCH 4
+#define LZ4_MFLIMIT 12
+#define LZ4_LASTLITERALS 5
+#define LZ4_MAXOFFSET 65535
+#define LZ4_HASHBITS 16
+#define LZ4_MAXCHAIN 256
+#define LZ4_NICEMATCH 4096
+
+struct matchfinder
+{
+	const UBYTE *src;
+	ULONG len;
+	ULONG next;
+	LONG *head;
+	LONG *prev;
+};
+
+static ULONG lz4_hash(const UBYTE *p)
+{
+	ULONG v = p[0] | (p[1] << 8) | (p[2] << 16) | ((ULONG)p[3] << 24);
+	return (v * 2654435761U) >> (32 - LZ4_HASHBITS);
+}
+
+// insert positions up to pos, return longest match at pos
+static ULONG lz4_findmatch(struct matchfinder *mf, ULONG pos, ULONG *offsetp)
+{
+	const UBYTE *src = mf->src;
+	ULONG limit = mf->len - LZ4_LASTLITERALS;
+	ULONG best = 0;
+
+	while (mf->next <= pos) {
+		ULONG h = lz4_hash(src + mf->next);
+		mf->prev[mf->next & LZ4_MAXOFFSET] = mf->head[h];
+		mf->head[h] = mf->next;
+		mf->next++;
+	}
+	LONG cand = mf->prev[pos & LZ4_MAXOFFSET];
+	for (int chain = 0; cand >= 0 && pos - cand <= LZ4_MAXOFFSET && chain < LZ4_MAXCHAIN; chain++) {
+		if (src[cand + best] == src[pos + best]) {
+			ULONG l = 0;
+			while (pos + l < limit && src[cand + l] == src[pos + l])
+				l++;
+			if (l > best) {
+				best = l;
+				*offsetp = pos - cand;
+				if (pos + l >= limit || l >= LZ4_NICEMATCH)
+					break;
+			}
+		}
+		LONG next = mf->prev[cand & LZ4_MAXOFFSET];
+		if (next >= cand)
+			break;
+		cand = next;
+	}
+	return best >= LZ4_MINMATCH ? best : 0;
+}
+
+static UBYTE *lz4_putlength(UBYTE *d, ULONG l)
+{
+	while (l >= 255) {
+		*d++ = 255;
+		l -= 255;
+	}
+	*d++ = l;
+	return d;
+}
+
+static UBYTE *lz4_sequence(UBYTE *d, const UBYTE *lit, ULONG litlen, ULONG offset, ULONG matchlen)
+{
+	UBYTE *token = d++;
+	*token = (litlen >= 15 ? 15 : litlen) << 4;
+	if (litlen >= 15)
+		d = lz4_putlength(d, litlen - 15);
+	memcpy(d, lit, litlen);
+	d += litlen;
+	if (!matchlen)
+		return d;
+	*d++ = offset;
+	*d++ = offset >> 8;
+	matchlen -= LZ4_MINMATCH;
+	*token |= matchlen >= 15 ? 15 : matchlen;
+	if (matchlen >= 15)
+		d = lz4_putlength(d, matchlen - 15);
+	return d;
+}
+
+// worst case output size
+static ULONG lz4_bound(ULONG len)
+{
+	return len + len / 255 + 16;
+}
+
+// lazy matching LZ4 block compressor, returns compressed size
+static ULONG lz4_compress(UBYTE *dst, const UBYTE *src, ULONG len)
+{
+	struct matchfinder mf;
+	UBYTE *d = dst;
+	ULONG pos = 0, anchor = 0;
+
+	mf.src = src;
+	mf.len = len;
+	mf.next = 0;
+	mf.head = malloc((1 << LZ4_HASHBITS) * sizeof(LONG));
+	mf.prev = malloc((LZ4_MAXOFFSET + 1) * sizeof(LONG));
+	memset(mf.head, 0xff, (1 << LZ4_HASHBITS) * sizeof(LONG));
+	memset(mf.prev, 0xff, (LZ4_MAXOFFSET + 1) * sizeof(LONG));
+
+	while (len > LZ4_MFLIMIT && pos + LZ4_MFLIMIT <= len) {
+		ULONG offset, offset2;
+		ULONG ml = lz4_findmatch(&mf, pos, &offset);
+		if (!ml) {
+			pos++;
+			continue;
+		}
+		// a longer match at the next byte is worth one more literal
+		while (ml < LZ4_NICEMATCH && pos + 1 + LZ4_MFLIMIT <= len) {
+			ULONG ml2 = lz4_findmatch(&mf, pos + 1, &offset2);
+			if (ml2 <= ml)
+				break;
+			pos++;
+			ml = ml2;
+			offset = offset2;
+		}
+		d = lz4_sequence(d, src + anchor, pos - anchor, offset, ml);
+		pos += ml;
+		anchor = pos;
+	}
+	d = lz4_sequence(d, src + anchor, len - anchor, 0, 0);
+
+	free(mf.head);
+	free(mf.prev);
+	return d - dst;
+}
+
+// returns FALSE if data is corrupt
+static int lz4_decompress(UBYTE *dst, ULONG len, const UBYTE *src, ULONG srclen)
+{
+	const UBYTE *s = src, *send = src + srclen;
+	UBYTE *d = dst, *dend = dst + len;
+
+	while (s < send) {
+		UBYTE token = *s++;
+		ULONG l = token >> 4;
+		if (l == 15) {
+			UBYTE b;
+			do {
+				if (s >= send)
+					return 0;
+				b = *s++;
+				l += b;
+			} while (b == 255);
+		}
+		if (l > send - s || l > dend - d)
+			return 0;
+		memcpy(d, s, l);
+		d += l;
+		s += l;
+		if (d == dend)
+			return s == send;
+		if (send - s < 2)
+			return 0;
+		ULONG offset = s[0] | (s[1] << 8);
+		s += 2;
+		if (!offset || offset > d - dst)
+			return 0;
+		l = token & 15;
+		if (l == 15) {
+			UBYTE b;
+			do {
+				if (s >= send)
+					return 0;
+				b = *s++;
+				l += b;
+			} while (b == 255);
+		}
+		l += LZ4_MINMATCH;
+		if (l > dend - d)
+			return 0;
+		for (ULONG i = 0; i < l; i++, d++)
+			*d = *(d - offset);
+	}
+	return d == dend;
+}
+
+// decompressed memory chunk data, NULL if corrupt
+static UBYTE *unpack_data(const UBYTE *data, ULONG size, ULONG flags, ULONG *lenp)
+{
+	if (!(flags & CHUNK_COMPRESSED)) {
+		UBYTE *b = malloc(size ? size : 1);
+		memcpy(b, data, size);
+		*lenp = size;
+		return b;
+	}
+	if (size < 8)
+		return NULL;
+	ULONG len = getlong(data);
+	UBYTE *b = malloc(len ? len : 1);
+	if (flags & CHUNK_LZ4) {
+		if (!lz4_decompress(b, len, data + 4, size - 8) || adler32(adler32(0, NULL, 0), b, len) != getlong(data + size - 4)) {
+			free(b);
+			return NULL;
+		}
+	} else {
+		uLongf dlen = len;
+		if (uncompress(b, &dlen, data + 4, size - 4) != Z_OK || dlen != len) {
+			free(b);
+			return NULL;
+		}
+	}
+	*lenp = len;
+	return b;
+}
+
+// sparse chunk header and page map size, 0 if invalid
+static ULONG sparse_headersize(const UBYTE *p, ULONG size)
+{
+	if (size < 12)
+		return 0;
+	ULONG len = getlong(p), pagesize = getlong(p + 4), datapages = getlong(p + 8);
+	if (pagesize < 4 || (pagesize & 3))
+		return 0;
+	ULONG pages = len / pagesize + (len % pagesize != 0);
+	if (datapages > pages)
+		return 0;
+	uint64_t hs = 12 + (pages + 31) / 32 * 4 + (uint64_t)(pages - datapages) * 4;
+	return hs <= size ? hs : 0;
+}
+
+// block chunk header and offset index size, 0 if invalid
+static ULONG blocks_headersize(const UBYTE *p, ULONG size)
+{
+	if (size < 12)
+		return 0;
+	ULONG len = getlong(p), blocksize = getlong(p + 4), blocks = getlong(p + 8);
+	if (blocksize < 4 || (blocksize & 3) || (len & 3))
+		return 0;
+	if (blocks != len / blocksize + (len % blocksize != 0))
+		return 0;
+	uint64_t hs = 12 + ((uint64_t)blocks + 1) * 4;
+	if (hs > size || getlong(p + 12) != hs || getlong(p + hs - 4) != size)
+		return 0;
+	for (ULONG i = 0; i < blocks; i++) {
+		ULONG bsize = getlong(p + 12 + i * 4 + 4) - getlong(p + 12 + i * 4);
+		if (bsize < 4 || bsize > size)
+			return 0;
+	}
+	return hs;
+}
+
+// each block is a complete stream, same as the chunk without blocks
+static UBYTE *unpack_blocks(const UBYTE *data, ULONG size, ULONG flags, ULONG *lenp)
+{
+	if (!blocks_headersize(data, size))
+		return NULL;
+	ULONG len = getlong(data), blocksize = getlong(data + 4), blocks = getlong(data + 8);
+	UBYTE *b = malloc(len ? len : 1);
+	UBYTE *s = malloc(blocksize + 4);
+	for (ULONG i = 0; i < blocks; i++) {
+		ULONG offset = i * blocksize;
+		ULONG n = len - offset < blocksize ? len - offset : blocksize;
+		ULONG start = getlong(data + 12 + i * 4);
+		ULONG bsize = getlong(data + 12 + i * 4 + 4) - start;
+		if (bsize == 4) {
+			for (ULONG j = 0; j < n; j++)
+				b[offset + j] = data[start + (j & 3)];
+			continue;
+		}
+		// block has no decompressed size of its own
+		s = realloc(s, bsize + 4);
+		putlong(s, n);
+		memcpy(s + 4, data + start, bsize);
+		ULONG blen;
+		UBYTE *block = unpack_data(s, bsize + 4, flags & ~CHUNK_BLOCKS, &blen);
+		if (!block || blen != n) {
+			free(block);
+			free(s);
+			free(b);
+			return NULL;
+		}
+		memcpy(b + offset, block, n);
+		free(block);
+	}
+	free(s);
+	*lenp = len;
+	return b;
+}
+
+static UBYTE *unpack_memory(const UBYTE *data, ULONG size, ULONG flags, ULONG *lenp)
+{
+	if (flags & CHUNK_BLOCKS)
+		return unpack_blocks(data, size, flags, lenp);
+	if (!(flags & CHUNK_SPARSE))
+		return unpack_data(data, size, flags, lenp);
+	ULONG hs = sparse_headersize(data, size);
+	if (!hs)
+		return NULL;
+	ULONG len = getlong(data), pagesize = getlong(data + 4);
+	ULONG pages = len / pagesize + (len % pagesize != 0);
+	ULONG plen, pos = 0;
+	UBYTE *packed = unpack_data(data + hs, size - hs, flags, &plen);
+	if (!packed)
+		return NULL;
+	const UBYTE *bitmap = data + 12;
+	const UBYTE *fill = bitmap + (pages + 31) / 32 * 4;
+	UBYTE *b = malloc(len ? len : 1);
+	for (ULONG i = 0; i < pages; i++) {
+		ULONG offset = i * pagesize;
+		ULONG n = len - offset < pagesize ? len - offset : pagesize;
+		if (bitmap[i >> 3] & (0x80 >> (i & 7))) {
+			if (n > plen - pos)
+				break;
+			memcpy(b + offset, packed + pos, n);
+			pos += n;
+		} else {
+			for (ULONG j = 0; j < n; j++)
+				b[offset + j] = fill[j & 3];
+			fill += 4;
+		}
+	}
+	free(packed);
+	if (pos != plen || fill != data + hs) {
+		free(b);
+		return NULL;
+	}
+	*lenp = len;
+	return b;
+}
+
+#define MODE_LZ4 0
+#define MODE_ZLIB 1
+#define MODE_FAST 2
+#define MODE_STORE 3
+
+static const char *mode_names[] = { "lz4", "zlib", "fast zlib", "uncompressed" };
+
+// sparse chunk page size
+#define SPARSE_PAGE 4096
+
+// compress memory chunk data: decompressed size, codec data
+static UBYTE *pack_data(const UBYTE *data, ULONG len, int mode, ULONG cpb, int threads, ULONG *sizep)
+{
+	if (mode == MODE_STORE) {
+		UBYTE *b = malloc(len ? len : 1);
+		memcpy(b, data, len);
+		*sizep = len;
+		return b;
+	}
+	ULONG max = mode == MODE_LZ4 ? lz4_bound(len) + 8 : mode == MODE_FAST ? deflate_bound(len) + 4 : compressBound(len) + 4;
+	UBYTE *b = malloc(max);
+	putlong(b, len);
+	if (mode == MODE_LZ4) {
+		ULONG clen = lz4_compress(b + 4, data, len);
+		putlong(b + 4 + clen, adler32(adler32(0, NULL, 0), data, len));
+		*sizep = clen + 8;
+	} else if (mode == MODE_FAST) {
+		*sizep = deflate_fast(b + 4, data, len, cpb, threads) + 4;
+	} else {
+		uLongf clen = max - 4;
+		compress2(b + 4, &clen, data, len, 9);
+		*sizep = clen + 4;
+	}
+	return b;
+}
+
+// Sparse: pages that repeat one longword are stored as that longword,
+// other pages are packed together and compressed as usual.
+// *datapagesp = number of data pages
+static UBYTE *pack_memory(const UBYTE *data, ULONG len, int mode, int sparse, ULONG cpb, int threads, ULONG *sizep, ULONG *datapagesp)
+{
+	ULONG pages = (len + SPARSE_PAGE - 1) / SPARSE_PAGE;
+	*datapagesp = pages;
+	if (!sparse)
+		return pack_data(data, len, mode, cpb, threads, sizep);
+
+	ULONG bitmapsize = (pages + 31) / 32 * 4;
+	UBYTE *head = calloc(12 + bitmapsize + pages * 4, 1);
+	UBYTE *fill = head + 12 + bitmapsize;
+	UBYTE *packed = malloc(len ? len : 1);
+	ULONG datapages = 0, plen = 0;
+	for (ULONG i = 0; i < pages; i++) {
+		ULONG offset = i * SPARSE_PAGE;
+		ULONG n = len - offset < SPARSE_PAGE ? len - offset : SPARSE_PAGE;
+		ULONG j = 4;
+		while (j < n && data[offset + j] == data[offset + (j & 3)])
+			j++;
+		if (j == n) {
+			memcpy(fill, data + offset, 4);
+			fill += 4;
+		} else {
+			head[12 + (i >> 3)] |= 0x80 >> (i & 7);
+			memcpy(packed + plen, data + offset, n);
+			plen += n;
+			datapages++;
+		}
+	}
+	putlong(head, len);
+	putlong(head + 4, SPARSE_PAGE);
+	putlong(head + 8, datapages);
+	ULONG hs = fill - head, psize;
+	UBYTE *payload = pack_data(packed, plen, mode, cpb, threads, &psize);
+	UBYTE *b = malloc(hs + psize);
+	memcpy(b, head, hs);
+	memcpy(b + hs, payload, psize);
+	free(payload);
+	free(packed);
+	free(head);
+	*sizep = hs + psize;
+	*datapagesp = datapages;
+	return b;
+}
+
+// Blocks: independently compressed blocks and their offsets, blocks that
+// repeat one longword are stored as that longword.
+static UBYTE *pack_blocks(const UBYTE *data, ULONG len, int mode, ULONG blocksize, ULONG cpb, int threads, ULONG *sizep, ULONG *datablocksp)
+{
+	ULONG blocks = (len + blocksize - 1) / blocksize;
+	ULONG hs = 12 + (blocks + 1) * 4;
+	ULONG size = hs, datablocks = 0;
+	UBYTE *b = malloc(hs);
+	putlong(b, len);
+	putlong(b + 4, blocksize);
+	putlong(b + 8, blocks);
+	for (ULONG i = 0; i < blocks; i++) {
+		ULONG offset = i * blocksize;
+		ULONG n = len - offset < blocksize ? len - offset : blocksize;
+		ULONG j = 4, bsize;
+		while (j < n && data[offset + j] == data[offset + (j & 3)])
+			j++;
+		putlong(b + 12 + i * 4, size);
+		if (j == n) {
+			b = realloc(b, size + 4);
+			memcpy(b + size, data + offset, 4);
+			size += 4;
+			continue;
+		}
+		// without the decompressed size, ussload knows it from the index
+		UBYTE *block = pack_data(data + offset, n, mode, cpb, threads, &bsize);
+		b = realloc(b, size + bsize - 4);
+		memcpy(b + size, block + 4, bsize - 4);
+		size += bsize - 4;
+		free(block);
+		datablocks++;
+	}
+	putlong(b + 12 + blocks * 4, size);
+	*sizep = size;
+	*datablocksp = datablocks;
+	return b;
+}
+
+static const char *const memchunknames[] = { "CRAM", "BRAM", "FRAM" };
+
+static int is_memchunk(const UBYTE *name)
+{
+	return !memcmp(name, "CRAM", 4) || !memcmp(name, "BRAM", 4) || !memcmp(name, "FRAM", 4);
+}
+
+// whole state file, NULL if it can't be read or is not a state file
+static UBYTE *load_state(const char *name, ULONG *lenp)
+{
+	FILE *f = fopen(name, "rb");
+	if (!f) {
+		printf("Couldn't open '%s'\n", name);
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	ULONG flen = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	UBYTE *fb = malloc(flen + 4);
+	if (fread(fb, 1, flen, f) != flen) {
+		printf("Read error while reading '%s'\n", name);
+		fclose(f);
+		free(fb);
+		return NULL;
+	}
+	fclose(f);
+	if (flen < 12 || memcmp(fb, "ASF ", 4)) {
+		printf("ERROR: '%s' is not UAE statefile.\n", name);
+		free(fb);
+		return NULL;
+	}
+	*lenp = flen;
+	return fb;
+}
+
+// chunk header, NULL if not found
+static const UBYTE *find_chunk(const UBYTE *fb, ULONG flen, const char *name)
+{
+	ULONG pos = 0;
+	while (pos + 12 <= flen) {
+		const UBYTE *p = fb + pos;
+		ULONG size = getlong(p + 4);
+		if (size < 12 || !memcmp(p, "END ", 4) || pos + size > flen)
+			break;
+		if (!memcmp(p, name, 4))
+			return p;
+		size -= 12;
+		pos += 12 + size + 4 - (size & 3);
+	}
+	return NULL;
+}
+
+// delta chunk page size
+#define DELTA_PAGE 4096
+
+// Delta state file: ASF, BASE (base state file name without path), all
+// other chunks as is, memory chunks as pages that differ from the base.
+// Unchanged memory chunks are left out.
+static int write_delta(const char *basename, const UBYTE *fb, ULONG flen, const char *outname)
+{
+	ULONG blen;
+	UBYTE *bb = load_state(basename, &blen);
+	if (!bb)
+		return 1;
+	if (find_chunk(bb, blen, "BASE")) {
+		printf("ERROR: Base state file is a delta state file.\n");
+		return 1;
+	}
+	for (int i = 0; i < 3; i++) {
+		if (!find_chunk(bb, blen, memchunknames[i]) != !find_chunk(fb, flen, memchunknames[i])) {
+			printf("ERROR: Chunk '%s' is not in both state files.\n", memchunknames[i]);
+			return 1;
+		}
+	}
+
+	FILE *fo = fopen(outname, "wb");
+	if (!fo) {
+		printf("Couldn't create '%s'\n", outname);
+		return 1;
+	}
+	const char *name = strrchr(basename, '/') ? strrchr(basename, '/') + 1 : basename;
+	ULONG pos = 0;
+	ULONG total_old = 0, total_new = 0;
+	UBYTE head[12], pad[4] = { 0 };
+	while (pos + 12 <= flen) {
+		const UBYTE *p = fb + pos;
+		ULONG size = getlong(p + 4);
+		ULONG flags = getlong(p + 8);
+		if (size < 12 || !memcmp(p, "END ", 4) || pos + size > flen)
+			break;
+		size -= 12;
+		ULONG total = 12 + size + 4 - (size & 3);
+		if (pos + total > flen)
+			total = flen - pos;
+		pos += total;
+		if (!is_memchunk(p)) {
+			fwrite(p, 1, total, fo);
+			if (!memcmp(p, "ASF ", 4)) {
+				ULONG namelen = strlen(name) + 1;
+				memcpy(head, "BASE", 4);
+				putlong(head + 4, namelen + 12);
+				putlong(head + 8, 0);
+				fwrite(head, 1, 12, fo);
+				fwrite(name, 1, namelen, fo);
+				fwrite(pad, 1, 4 - (namelen & 3), fo);
+			}
+			continue;
+		}
+		const UBYTE *bp = find_chunk(bb, blen, (const char*)p);
+		ULONG len, baselen;
+		UBYTE *mem = unpack_memory(p + 12, size, flags, &len);
+		UBYTE *base = unpack_memory(bp + 12, getlong(bp + 4) - 12, getlong(bp + 8), &baselen);
+		if (!mem || !base) {
+			printf("ERROR: Chunk '%.4s' is corrupt.\n", p);
+			return 1;
+		}
+		if (len != baselen || !len || (len % DELTA_PAGE)) {
+			printf("ERROR: Chunk '%.4s' size does not match base state file.\n", p);
+			return 1;
+		}
+		ULONG pages = len / DELTA_PAGE;
+		ULONG bitmapsize = (pages + 31) / 32 * 4;
+		UBYTE *d = calloc(12 + bitmapsize + len, 1);
+		ULONG changed = 0;
+		for (ULONG i = 0; i < pages; i++) {
+			ULONG offset = i * DELTA_PAGE;
+			if (memcmp(mem + offset, base + offset, DELTA_PAGE)) {
+				d[12 + (i >> 3)] |= 0x80 >> (i & 7);
+				memcpy(d + 12 + bitmapsize + changed * DELTA_PAGE, mem + offset, DELTA_PAGE);
+				changed++;
+			}
+		}
+		putlong(d, len);
+		putlong(d + 4, DELTA_PAGE);
+		putlong(d + 8, changed);
+		ULONG newsize = changed ? 12 + bitmapsize + changed * DELTA_PAGE : 0;
+		printf("%.4s: %luk, %lu/%lu pages changed, %lu -> %lu bytes.\n", p, (unsigned long)len >> 10,
+			(unsigned long)changed, (unsigned long)pages, (unsigned long)size, (unsigned long)newsize);
+		if (changed) {
+			memcpy(head, p, 4);
+			putlong(head + 4, newsize + 12);
+			putlong(head + 8, CHUNK_DELTA);
+			fwrite(head, 1, 12, fo);
+			fwrite(d, 1, newsize, fo);
+			fwrite(pad, 1, 4 - (newsize & 3), fo);
+		}
+		total_old += size;
+		total_new += newsize;
+		free(d);
+		free(base);
+		free(mem);
+	}
+	// END chunk and anything after it
+	fwrite(fb + pos, 1, flen - pos, fo);
+	fclose(fo);
+	free(bb);
+	printf("Memory chunks %lu -> %lu bytes.\n", (unsigned long)total_old, (unsigned long)total_new);
+	return 0;
+}
+
+// next TOC entry: chunk header of the stream at offset, its first data bytes
+static UBYTE *native_entry(UBYTE *e, const UBYTE *stream, ULONG offset, ULONG len)
+{
+	const UBYTE *p = stream + offset;
+	ULONG size = getlong(p + 4);
+	ULONG datasize = size > 12 ? size - 12 : 0;
+	if (datasize > NATIVE_PREFIX)
+		datasize = NATIVE_PREFIX;
+	memset(e, 0, NATIVE_ENTRY);
+	memcpy(e, p, len - offset < 12 ? len - offset : 12);
+	putlong(e + 12, offset);
+	memcpy(e + 16, p + 12, datasize);
+	return e + NATIVE_ENTRY;
+}
+
+// Native state file: TOC, then the state file with all small chunks first
+// and memory chunks in ussload order, data page aligned in the file. FPU
+// registers are converted to 12 byte extended format.
+static int write_native(const UBYTE *fb, ULONG flen, const char *outname)
+{
+	const UBYTE **chunks = malloc((flen / 12 + 1) * sizeof(UBYTE*));
+	const UBYTE *mem[3] = { NULL };
+	int nchunks = 0, nmem = 0;
+	ULONG pos = 0;
+	while (pos + 12 <= flen) {
+		const UBYTE *p = fb + pos;
+		ULONG size = getlong(p + 4);
+		if (size < 12 || !memcmp(p, "END ", 4) || pos + size > flen)
+			break;
+		size -= 12;
+		pos += 12 + size + 4 - (size & 3);
+		if (pos > flen)
+			pos = flen;
+		int i = 0;
+		while (i < 3 && (memcmp(p, memchunknames[i], 4) || mem[i]))
+			i++;
+		if (i < 3) {
+			mem[i] = p;
+			nmem++;
+		} else {
+			chunks[nchunks++] = p;
+		}
+	}
+	// small chunks, PAD and memory chunk pairs, END
+	ULONG entries = nchunks + 2 * nmem + 1;
+	ULONG base = NATIVE_HEAD + entries * NATIVE_ENTRY;
+	UBYTE *s = calloc(flen + 3 * (NATIVE_PAGE + 32) + 64, 1);
+	UBYTE *toc = calloc(base, 1);
+	UBYTE *e = toc + NATIVE_HEAD;
+	ULONG len = 0;
+	for (int i = 0; i < nchunks; i++) {
+		const UBYTE *p = chunks[i];
+		ULONG size = getlong(p + 4) - 12;
+		ULONG total = 12 + size + 4 - (size & 3);
+		if (p + total > fb + flen)
+			total = fb + flen - p;
+		ULONG offset = len;
+		if (!memcmp(p, "FPU ", 4) && size >= 8 + 8 * 10 + 3 * 4 && !(getlong(p + 8) & CHUNK_FPU12)) {
+			// model, flags, 8 * 10 byte registers -> 8 * 12, rest as is
+			UBYTE *d = s + len + 12;
+			const UBYTE *src = p + 12;
+			memcpy(d, src, 8);
+			d += 8;
+			src += 8;
+			for (int j = 0; j < 8; j++) {
+				memcpy(d, src, 2);
+				memcpy(d + 4, src + 2, 8);
+				d += 12;
+				src += 10;
+			}
+			memcpy(d, src, size - 8 - 8 * 10);
+			size += 8 * 2;
+			memcpy(s + len, p, 4);
+			putlong(s + len + 4, size + 12);
+			putlong(s + len + 8, getlong(p + 8) | CHUNK_FPU12);
+			len += 12 + size + 4 - (size & 3);
+		} else {
+			memcpy(s + len, p, total);
+			len += total;
+		}
+		e = native_entry(e, s, offset, len);
+	}
+	ULONG region = len;
+	for (int i = 0; i < 3; i++) {
+		if (!mem[i])
+			continue;
+		ULONG size = getlong(mem[i] + 4) - 12;
+		ULONG total = 12 + size + 4 - (size & 3);
+		if (mem[i] + total > fb + flen)
+			total = fb + flen - mem[i];
+		// PAD chunk so that memory chunk data starts at a page boundary
+		ULONG gap = (NATIVE_PAGE - (base + len + 12) % NATIVE_PAGE) % NATIVE_PAGE;
+		if (gap < 12 + 4 + 4)
+			gap += NATIVE_PAGE;
+		memcpy(s + len, "PAD ", 4);
+		putlong(s + len + 4, gap - 4);
+		putlong(s + len + 8, 0);
+		e = native_entry(e, s, len, len + gap);
+		len += gap;
+		memcpy(s + len, mem[i], total);
+		e = native_entry(e, s, len, len + total);
+		len += total;
+	}
+	if (pos < flen) {
+		// END chunk and anything after it
+		memcpy(s + len, fb + pos, flen - pos);
+		e = native_entry(e, s, len, len + flen - pos);
+		len += flen - pos;
+	} else {
+		memcpy(s + len, "END ", 4);
+		putlong(s + len + 4, 8);
+		e = native_entry(e, s, len, len + 8);
+		len += 8;
+	}
+	memcpy(toc, "USSN", 4);
+	putlong(toc + 4, base);
+	putlong(toc + 8, entries);
+	putlong(toc + 12, region);
+
+	FILE *fo = fopen(outname, "wb");
+	if (!fo) {
+		printf("Couldn't create '%s'\n", outname);
+		return 1;
+	}
+	fwrite(toc, 1, base, fo);
+	fwrite(s, 1, len, fo);
+	fclose(fo);
+	printf("Native state file, %lu bytes of small chunks, %d memory chunks page aligned.\n",
+		(unsigned long)region, nmem);
+	free(chunks);
+	free(toc);
+	free(s);
+	return 0;
+}
+
+// predicted 68000 decode time of a zlib memory chunk in Mcycles, <0 if not zlib
+static double predict(const UBYTE *data, ULONG size, ULONG flags, struct deflatestats *ds)
+{
+	if ((flags & (CHUNK_COMPRESSED | CHUNK_LZ4)) != CHUNK_COMPRESSED)
+		return -1;
+	if (flags & CHUNK_BLOCKS) {
+		if (!blocks_headersize(data, size))
+			return -1;
+		ULONG len = getlong(data), blocksize = getlong(data + 4);
+		struct deflatestats bs;
+		memset(ds, 0, sizeof(struct deflatestats));
+		for (ULONG i = 0; i < getlong(data + 8); i++) {
+			ULONG start = getlong(data + 12 + i * 4);
+			ULONG bsize = getlong(data + 12 + i * 4 + 4) - start;
+			ULONG n = len - i * blocksize < blocksize ? len - i * blocksize : blocksize;
+			if (bsize == 4)
+				continue;
+			if (!deflate_predict(data + start, bsize, n, &bs))
+				return -1;
+			ds->blocks += bs.blocks;
+			ds->cycles += bs.cycles;
+			for (int j = 0; j < 4; j++)
+				ds->types[j] += bs.types[j];
+			ds->cached += bs.cached;
+			ds->literals += bs.literals;
+			ds->pairs += bs.pairs;
+			ds->matches += bs.matches;
+			ds->treewalks += bs.treewalks;
+			for (int j = 0; j < 8; j++)
+				ds->lengths[j] += bs.lengths[j];
+		}
+		return ds->cycles / 1000000.0;
+	}
+	if (flags & CHUNK_SPARSE) {
+		ULONG hs = sparse_headersize(data, size);
+		if (!hs)
+			return -1;
+		data += hs;
+		size -= hs;
+	}
+	if (size < 4)
+		return -1;
+	if (!deflate_predict(data + 4, size - 4, getlong(data), ds))
+		return -1;
+	return ds->cycles / 1000000.0;
+}
+
+// bundle page size
+#define BUNDLE_PAGE 4096
+
+// bundle input state: file, memory chunks padded to full pages, page hashes
+struct bundlestate
+{
+	const char *path;
+	char name[BUNDLE_NAME];
+	UBYTE *fb;
+	ULONG flen;
+	UBYTE *mem[3];
+	ULONG memlen[3];
+	uint64_t *hash[3];
+	int error;
+};
+
+struct bundler
+{
+	struct bundlestate *states;
+	int nstates;
+	int next;
+	pthread_mutex_t lock;
+};
+
+// FNV-1a, page content address
+static uint64_t page_hash(const UBYTE *p)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (ULONG i = 0; i < BUNDLE_PAGE; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static void bundle_load(struct bundlestate *bs)
+{
+	bs->fb = load_state(bs->path, &bs->flen);
+	if (!bs->fb) {
+		bs->error = 1;
+		return;
+	}
+	if (find_chunk(bs->fb, bs->flen, "BASE")) {
+		printf("ERROR: '%s' is a delta state file.\n", bs->path);
+		bs->error = 1;
+		return;
+	}
+	for (int i = 0; i < 3; i++) {
+		const UBYTE *p = find_chunk(bs->fb, bs->flen, memchunknames[i]);
+		if (!p)
+			continue;
+		ULONG len;
+		UBYTE *mem = unpack_memory(p + 12, getlong(p + 4) - 12, getlong(p + 8), &len);
+		if (!mem) {
+			printf("ERROR: '%s' chunk '%s' is corrupt.\n", bs->path, memchunknames[i]);
+			bs->error = 1;
+			return;
+		}
+		ULONG pages = (len + BUNDLE_PAGE - 1) / BUNDLE_PAGE;
+		bs->mem[i] = realloc(mem, pages * BUNDLE_PAGE + 1);
+		memset(bs->mem[i] + len, 0, pages * BUNDLE_PAGE - len);
+		bs->memlen[i] = len;
+		bs->hash[i] = malloc((pages + 1) * sizeof(uint64_t));
+		for (ULONG j = 0; j < pages; j++)
+			bs->hash[i][j] = page_hash(bs->mem[i] + j * BUNDLE_PAGE);
+	}
+}
+
+static void *bundle_thread(void *arg)
+{
+	struct bundler *b = arg;
+	for (;;) {
+		pthread_mutex_lock(&b->lock);
+		int i = b->next++;
+		pthread_mutex_unlock(&b->lock);
+		if (i >= b->nstates)
+			break;
+		bundle_load(&b->states[i]);
+	}
+	return NULL;
+}
+
+// unique pages: content, hash and open addressing hash table
+struct pagestore
+{
+	UBYTE *data;
+	uint64_t *hash;
+	ULONG pages, alloc;
+	LONG *table;
+	ULONG mask;
+};
+
+// page number of page content, added if new. Zero page is not stored.
+static ULONG page_ref(struct pagestore *ps, const UBYTE *p, uint64_t h)
+{
+	static const UBYTE zero[BUNDLE_PAGE];
+	if (!memcmp(p, zero, BUNDLE_PAGE))
+		return BUNDLE_ZERO;
+	ULONG slot = h & ps->mask;
+	while (ps->table[slot] >= 0) {
+		ULONG n = ps->table[slot];
+		if (ps->hash[n] == h && !memcmp(ps->data + (size_t)n * BUNDLE_PAGE, p, BUNDLE_PAGE))
+			return n;
+		slot = (slot + 1) & ps->mask;
+	}
+	if (ps->pages == ps->alloc) {
+		ps->alloc = ps->alloc ? ps->alloc * 2 : 256;
+		ps->data = realloc(ps->data, (size_t)ps->alloc * BUNDLE_PAGE);
+		ps->hash = realloc(ps->hash, ps->alloc * sizeof(uint64_t));
+	}
+	memcpy(ps->data + (size_t)ps->pages * BUNDLE_PAGE, p, BUNDLE_PAGE);
+	ps->hash[ps->pages] = h;
+	ps->table[slot] = ps->pages;
+	return ps->pages++;
+}
+
+// state file with memory chunks as page lists (CHUNK_PAGES)
+static UBYTE *bundle_toc(struct bundlestate *bs, struct pagestore *ps, ULONG *sizep)
+{
+	const UBYTE *fb = bs->fb;
+	ULONG flen = bs->flen, pos = 0;
+	ULONG max = flen + 64;
+	for (int i = 0; i < 3; i++)
+		max += (bs->memlen[i] + BUNDLE_PAGE - 1) / BUNDLE_PAGE * 4 + 32;
+	UBYTE *toc = calloc(max, 1);
+	UBYTE *d = toc;
+	while (pos + 12 <= flen) {
+		const UBYTE *p = fb + pos;
+		ULONG size = getlong(p + 4);
+		if (size < 12 || !memcmp(p, "END ", 4) || pos + size > flen)
+			break;
+		size -= 12;
+		ULONG total = 12 + size + 4 - (size & 3);
+		if (pos + total > flen)
+			total = flen - pos;
+		pos += total;
+		int m;
+		for (m = 0; m < 3; m++) {
+			if (!memcmp(p, memchunknames[m], 4))
+				break;
+		}
+		if (m == 3) {
+			memcpy(d, p, total);
+			d += total;
+			continue;
+		}
+		ULONG pages = (bs->memlen[m] + BUNDLE_PAGE - 1) / BUNDLE_PAGE;
+		memcpy(d, p, 4);
+		putlong(d + 4, 12 + 4 + pages * 4);
+		putlong(d + 8, CHUNK_PAGES);
+		putlong(d + 12, bs->memlen[m]);
+		for (ULONG i = 0; i < pages; i++)
+			putlong(d + 16 + i * 4, page_ref(ps, bs->mem[m] + i * BUNDLE_PAGE, bs->hash[m][i]));
+		// data size is a multiple of 4: 4 bytes of padding
+		d += 16 + pages * 4 + 4;
+	}
+	// END chunk and anything after it
+	memcpy(d, fb + pos, flen - pos);
+	d += flen - pos;
+	*sizep = d - toc;
+	return toc;
+}
+
+struct bundleentry
+{
+	char name[BUNDLE_NAME];
+	ULONG type;
+	UBYTE *data;
+	ULONG size;
+};
+
+// Kickstart images load_rom() would look for, from romdir
+static int bundle_roms(struct bundlestate *states, int nstates, const char *romdir, struct bundleentry *e, int n)
+{
+	static const char *const models[] = { "a500", "a1200" };
+	for (int i = 0; i < nstates; i++) {
+		const UBYTE *p = find_chunk(states[i].fb, states[i].flen, "ROM ");
+		if (!p || getlong(p + 4) < 12 + 16)
+			continue;
+		ULONG ver = (p[12 + 12] << 8) | p[12 + 13];
+		ULONG rev = (p[12 + 14] << 8) | p[12 + 15];
+		for (int j = 0; j < 2; j++) {
+			char name[BUNDLE_NAME], path[1024];
+			snprintf(name, sizeof name, "kick%u%03u.%s", ver, rev, models[j]);
+			int k;
+			for (k = 0; k < n; k++) {
+				if (e[k].type == BUNDLE_ROM && !strcmp(e[k].name, name))
+					break;
+			}
+			if (k < n)
+				continue;
+			snprintf(path, sizeof path, "%s/%s", romdir, name);
+			FILE *f = fopen(path, "rb");
+			if (!f)
+				continue;
+			fseek(f, 0, SEEK_END);
+			ULONG size = ftell(f);
+			fseek(f, 0, SEEK_SET);
+			UBYTE *data = malloc(size + 1);
+			if (fread(data, 1, size, f) == size) {
+				memset(e[n].name, 0, BUNDLE_NAME);
+				strcpy(e[n].name, name);
+				e[n].type = BUNDLE_ROM;
+				e[n].data = data;
+				e[n].size = size;
+				n++;
+				printf("ROM '%s', %luk.\n", name, (unsigned long)size >> 10);
+			} else {
+				free(data);
+			}
+			fclose(f);
+		}
+	}
+	return n;
+}
+
+// Bundle: many state files, memory pages stored once. States are loaded,
+// decompressed and hashed in parallel, pages are deduplicated in order.
+static int write_bundle(const char *outname, int nfiles, char **files, const char *romdir, int threads)
+{
+	struct bundler b;
+	b.states = calloc(nfiles, sizeof(struct bundlestate));
+	b.nstates = nfiles;
+	b.next = 0;
+	for (int i = 0; i < nfiles; i++) {
+		struct bundlestate *bs = &b.states[i];
+		const char *name = strrchr(files[i], '/') ? strrchr(files[i], '/') + 1 : files[i];
+		size_t len = strlen(name);
+		if (len > 4 && !strcasecmp(name + len - 4, ".uss"))
+			len -= 4;
+		if (len >= BUNDLE_NAME) {
+			printf("ERROR: State name '%s' too long.\n", name);
+			return 1;
+		}
+		bs->path = files[i];
+		memcpy(bs->name, name, len);
+		for (int j = 0; j < i; j++) {
+			if (!strcasecmp(b.states[j].name, bs->name)) {
+				printf("ERROR: Duplicate state name '%s'.\n", bs->name);
+				return 1;
+			}
+		}
+	}
+	pthread_mutex_init(&b.lock, NULL);
+	if (threads > nfiles)
+		threads = nfiles;
+	if (threads < 1)
+		threads = 1;
+	pthread_t *tids = malloc(threads * sizeof(pthread_t));
+	for (int i = 1; i < threads; i++)
+		pthread_create(&tids[i], NULL, bundle_thread, &b);
+	bundle_thread(&b);
+	for (int i = 1; i < threads; i++)
+		pthread_join(tids[i], NULL);
+	free(tids);
+	pthread_mutex_destroy(&b.lock);
+
+	ULONG totalpages = 0;
+	uint64_t inputsize = 0;
+	for (int i = 0; i < nfiles; i++) {
+		if (b.states[i].error)
+			return 1;
+		inputsize += b.states[i].flen;
+		for (int j = 0; j < 3; j++)
+			totalpages += (b.states[i].memlen[j] + BUNDLE_PAGE - 1) / BUNDLE_PAGE;
+	}
+	struct pagestore ps = { 0 };
+	ULONG tablesize = 1024;
+	while (tablesize < totalpages * 2)
+		tablesize *= 2;
+	ps.table = malloc(tablesize * sizeof(LONG));
+	memset(ps.table, 0xff, tablesize * sizeof(LONG));
+	ps.mask = tablesize - 1;
+
+	// states, then ROM images (2 per state at most)
+	struct bundleentry *e = calloc(nfiles * 3, sizeof(struct bundleentry));
+	for (int i = 0; i < nfiles; i++) {
+		strcpy(e[i].name, b.states[i].name);
+		e[i].type = BUNDLE_STATE;
+		e[i].data = bundle_toc(&b.states[i], &ps, &e[i].size);
+	}
+	int n = nfiles;
+	if (romdir)
+		n = bundle_roms(b.states, nfiles, romdir, e, n);
+
+	FILE *fo = fopen(outname, "wb");
+	if (!fo) {
+		printf("Couldn't create '%s'\n", outname);
+		return 1;
+	}
+	UBYTE head[BUNDLE_HEAD], entry[BUNDLE_ENTRY];
+	ULONG offset = BUNDLE_HEAD + n * BUNDLE_ENTRY;
+	for (int i = 0; i < n; i++)
+		offset += (e[i].size + 3) & ~3;
+	// page data starts at a disk block boundary
+	ULONG pagedata = (offset + 511) & ~511;
+	memcpy(head, "USSB", 4);
+	putlong(head + 4, n);
+	putlong(head + 8, BUNDLE_PAGE);
+	putlong(head + 12, pagedata);
+	fwrite(head, 1, BUNDLE_HEAD, fo);
+	offset = BUNDLE_HEAD + n * BUNDLE_ENTRY;
+	for (int i = 0; i < n; i++) {
+		memcpy(entry, e[i].name, BUNDLE_NAME);
+		putlong(entry + BUNDLE_NAME, e[i].type);
+		putlong(entry + BUNDLE_NAME + 4, offset);
+		putlong(entry + BUNDLE_NAME + 8, e[i].size);
+		fwrite(entry, 1, BUNDLE_ENTRY, fo);
+		offset += (e[i].size + 3) & ~3;
+	}
+	static const UBYTE pad[512];
+	for (int i = 0; i < n; i++) {
+		fwrite(e[i].data, 1, e[i].size, fo);
+		fwrite(pad, 1, -e[i].size & 3, fo);
+		free(e[i].data);
+	}
+	fwrite(pad, 1, pagedata - offset, fo);
+	// page index, then the pages, LZ4 compressed if that is smaller
+	UBYTE *packed = malloc(lz4_bound(BUNDLE_PAGE));
+	UBYTE *index = malloc(4 + (ps.pages + 1) * 4);
+	ULONG pos = pagedata + 4 + (ps.pages + 1) * 4;
+	ULONG compressed = 0;
+	putlong(index, ps.pages);
+	fseek(fo, pos, SEEK_SET);
+	for (ULONG i = 0; i < ps.pages; i++) {
+		const UBYTE *p = ps.data + (size_t)i * BUNDLE_PAGE;
+		ULONG len = lz4_compress(packed, p, BUNDLE_PAGE);
+		putlong(index + 4 + i * 4, pos);
+		if (len < BUNDLE_PAGE) {
+			fwrite(packed, 1, len, fo);
+			compressed++;
+		} else {
+			fwrite(p, 1, len = BUNDLE_PAGE, fo);
+		}
+		pos += len;
+	}
+	putlong(index + 4 + ps.pages * 4, pos);
+	fseek(fo, pagedata, SEEK_SET);
+	fwrite(index, 1, 4 + (ps.pages + 1) * 4, fo);
+	free(index);
+	free(packed);
+	uint64_t outsize = pos;
+	fclose(fo);
+	printf("%d states, %lu memory pages, %lu stored (%lu compressed). %llu -> %llu bytes.\n", nfiles,
+		(unsigned long)totalpages, (unsigned long)ps.pages, (unsigned long)compressed,
+		(unsigned long long)inputsize, (unsigned long long)outsize);
+	// inputs are usually zlib compressed, pages only are shared
+	if (outsize > inputsize)
+		printf("WARNING: Bundle is larger than its state files, states share few pages.\n");
+	return 0;
+}
+
+// decode profile, same counters as ussload built with "make STATS=1"
+static void print_stats(const UBYTE *name, const struct deflatestats *ds)
+{
+	printf("%.4s: %u stored, %u static (%u cached), %u dynamic blocks, %u table builds.\n",
+		name, ds->types[0], ds->types[1], ds->cached, ds->types[2],
+		ds->types[1] + ds->types[2] - ds->cached);
+	printf(" %u literals (%u pairs), %u matches, %u tree walks.\n",
+		ds->literals, ds->pairs, ds->matches, ds->treewalks);
+	printf(" Match lengths 3/4-7/8-15/../256-258:");
+	for (int i = 0; i < 8; i++)
+		printf(" %u", ds->lengths[i]);
+	printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int mode = MODE_LZ4;
+	int sparse = 0;
+	ULONG blocksize = 0;
+	int verbose = 0;
+	const char *delta = NULL;
+	const char *romdir = NULL;
+	int bundle = 0;
+	int native = 0;
+	ULONG cpb = 8;
+	int threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int argi = 1;
+
+	while (argi < argc && argv[argi][0] == '-') {
+		if (!strcmp(argv[argi], "-z")) {
+			mode = MODE_ZLIB;
+		} else if (!strcmp(argv[argi], "-f")) {
+			mode = MODE_FAST;
+		} else if (!strcmp(argv[argi], "-n")) {
+			mode = MODE_STORE;
+		} else if (!strcmp(argv[argi], "-s")) {
+			sparse = 1;
+		} else if (!strcmp(argv[argi], "-B") && argi + 1 < argc) {
+			blocksize = strtoul(argv[++argi], NULL, 0) * 1024;
+		} else if (!strcmp(argv[argi], "-v")) {
+			verbose = 1;
+		} else if (!strcmp(argv[argi], "-c") && argi + 1 < argc) {
+			cpb = strtoul(argv[++argi], NULL, 0);
+		} else if (!strcmp(argv[argi], "-N")) {
+			native = 1;
+		} else if (!strcmp(argv[argi], "-b")) {
+			bundle = 1;
+		} else if (!strcmp(argv[argi], "-k") && argi + 1 < argc) {
+			romdir = argv[++argi];
+		} else if (!strcmp(argv[argi], "-d") && argi + 1 < argc) {
+			delta = argv[++argi];
+		} else if (!strcmp(argv[argi], "-t") && argi + 1 < argc) {
+			threads = atoi(argv[++argi]);
+		} else {
+			break;
+		}
+		argi++;
+	}
+	if (bundle && argc - argi >= 2)
+		return write_bundle(argv[argi], argc - argi - 1, argv + argi + 1, romdir, threads);
+	if (argc - argi != 2 || bundle || (native && delta) || (blocksize && (sparse || mode == MODE_STORE))) {
+		printf("Syntax: usspack [-z|-f|-n] [-s|-B <kB>] [-N] [-v] [-c <cycles per bit>] [-t <threads>] <in.uss> <out.uss>\n");
+		printf("- Recompress memory chunks with LZ4 (default), zlib (-z),\n");
+		printf("  zlib optimized for 68000 decompression speed (-f) or uncompressed (-n).\n");
+		printf("- -s: sparse, constant filled pages are stored as one longword.\n");
+		printf("- -B: independently compressed blocks of <kB> size (not with -n or -s).\n");
+		printf("- -N: native state file, small chunks first, memory chunks page aligned.\n");
+		printf("- -v: print inflate decode profile of zlib memory chunks.\n");
+		printf("- -c: cycles one compressed bit is worth (load time vs decompression time), default 8.\n");
+		printf("- -t: compression threads, default all CPUs.\n");
+		printf("usspack -d <base.uss> <in.uss> <delta.uss>\n");
+		printf("- Write delta state file: changed memory pages against base state file.\n");
+		printf("usspack -b [-k <rom dir>] [-t <threads>] <out.ussb> <in.uss>...\n");
+		printf("- Write bundle of state files, memory pages stored once, ROM images from rom dir.\n");
+		return 1;
+	}
+
+	ULONG flen;
+	UBYTE *fb = load_state(argv[argi], &flen);
+	if (!fb)
+		return 1;
+	if (delta)
+		return write_delta(delta, fb, flen, argv[argi + 1]);
+
+	// native: recompressed state file to memory first
+	char *nb = NULL;
+	size_t nlen = 0;
+	FILE *fo = native ? open_memstream(&nb, &nlen) : fopen(argv[argi + 1], "wb");
+	if (!fo) {
+		printf("Couldn't create '%s'\n", argv[argi + 1]);
+		return 1;
+	}
+	ULONG pos = 0;
+	ULONG total_old = 0, total_new = 0;
+	while (pos + 12 <= flen) {
+		UBYTE *p = fb + pos;
+		ULONG size = getlong(p + 4);
+		ULONG flags = getlong(p + 8);
+		if (size < 12 || !memcmp(p, "END ", 4) || pos + size > flen)
+			break;
+		size -= 12;
+		// chunk data is followed by 1-4 bytes of padding
+		ULONG total = 12 + size + 4 - (size & 3);
+		if (pos + total > flen)
+			total = flen - pos;
+		if (!is_memchunk(p)) {
+			fwrite(p, 1, total, fo);
+			pos += total;
+			continue;
+		}
+		ULONG len;
+		UBYTE *mem = unpack_memory(p + 12, size, flags, &len);
+		if (!mem) {
+			printf("ERROR: Chunk '%.4s' is corrupt.\n", p);
+			return 1;
+		}
+		ULONG newsize, chk, datapages;
+		// ussload fills pages with longwords
+		int sparsechunk = sparse && !(len & 3);
+		int blockchunk = blocksize && !(len & 3);
+		UBYTE *packed;
+		if (blockchunk)
+			packed = pack_blocks(mem, len, mode, blocksize, cpb, threads, &newsize, &datapages);
+		else
+			packed = pack_memory(mem, len, mode, sparsechunk, cpb, threads, &newsize, &datapages);
+		ULONG newflags = flags & ~(CHUNK_COMPRESSED | CHUNK_LZ4 | CHUNK_SPARSE | CHUNK_BLOCKS);
+		if (mode != MODE_STORE)
+			newflags |= CHUNK_COMPRESSED;
+		if (mode == MODE_LZ4)
+			newflags |= CHUNK_LZ4;
+		if (sparsechunk)
+			newflags |= CHUNK_SPARSE;
+		if (blockchunk)
+			newflags |= CHUNK_BLOCKS;
+		UBYTE *verify = unpack_memory(packed, newsize, newflags, &chk);
+		if (!verify || chk != len || memcmp(verify, mem, len)) {
+			printf("ERROR: Chunk '%.4s' verify failed.\n", p);
+			return 1;
+		}
+		printf("%.4s: %luk, %lu -> %lu bytes (%s)", p, (unsigned long)len >> 10,
+			(unsigned long)size, (unsigned long)newsize, mode_names[mode]);
+		if (sparsechunk)
+			printf(", %lu/%lu data pages", (unsigned long)datapages, (unsigned long)(len + SPARSE_PAGE - 1) / SPARSE_PAGE);
+		if (blockchunk)
+			printf(", %lu/%lu data blocks", (unsigned long)datapages, (unsigned long)(len + blocksize - 1) / blocksize);
+		// 68000 decode time estimate of zlib chunks
+		struct deflatestats oldds, newds;
+		double oldcyc = predict(p + 12, size, flags, &oldds);
+		double newcyc = predict(packed, newsize, newflags, &newds);
+		if (oldcyc >= 0 && newcyc >= 0)
+			printf(", 68000 inflate %.1f -> %.1f Mcycles", oldcyc, newcyc);
+		else if (oldcyc >= 0 || newcyc >= 0)
+			printf(", 68000 inflate %.1f Mcycles", oldcyc >= 0 ? oldcyc : newcyc);
+		printf(".\n");
+		// profile of the written chunk, or of the original if it was zlib
+		if (verbose && (newcyc >= 0 || oldcyc >= 0))
+			print_stats(p, newcyc >= 0 ? &newds : &oldds);
+		total_old += size;
+		total_new += newsize;
+		UBYTE head[12], pad[4] = { 0 };
+		memcpy(head, p, 4);
+		putlong(head + 4, newsize + 12);
+		putlong(head + 8, newflags);
+		fwrite(head, 1, 12, fo);
+		fwrite(packed, 1, newsize, fo);
+		fwrite(pad, 1, 4 - (newsize & 3), fo);
+		free(verify);
+		free(packed);
+		free(mem);
+		pos += total;
+	}
+	// END chunk and anything after it
+	fwrite(fb + pos, 1, flen - pos, fo);
+	fclose(fo);
+	free(fb);
+	printf("Memory chunks %lu -> %lu bytes.\n", (unsigned long)total_old, (unsigned long)total_new);
+	if (native) {
+		int ret = write_native((UBYTE*)nb, nlen, argv[argi + 1]);
+		free(nb);
+		return ret;
+	}
+	return 0;
+}
@@ -0,0 +1,51 @@
+
+// usspack (host tool) shared definitions
+
+#include <stdint.h>
+
+typedef uint8_t UBYTE;
+typedef uint16_t UWORD;
+typedef uint32_t ULONG;
+typedef int32_t LONG;
+
+// memory chunk flags (header.h)
+#define CHUNK_COMPRESSED 1
+#define CHUNK_LZ4 0x100
+#define CHUNK_SPARSE 0x200
+#define CHUNK_DELTA 0x400
+#define CHUNK_PAGES 0x800
+#define CHUNK_BLOCKS 0x1000
+#define CHUNK_FPU12 0x2000
+
+// bundle file (header.h)
+#define BUNDLE_HEAD 16
+#define BUNDLE_ENTRY 48
+#define BUNDLE_NAME 36
+#define BUNDLE_STATE 0
+#define BUNDLE_ROM 1
+#define BUNDLE_ZERO 0xffffffff
+
+// native state file (header.h)
+#define NATIVE_HEAD 16
+#define NATIVE_ENTRY 32
+#define NATIVE_PREFIX 16
+#define NATIVE_PAGE 4096
+
+// same counters as ussload's inflate decode profile (struct inflatestats)
+struct deflatestats
+{
+	ULONG blocks;
+	uint64_t cycles;
+	ULONG types[4]; // stored, static, dynamic, invalid
+	ULONG cached; // static blocks after the first, tables not rebuilt
+	ULONG literals;
+	ULONG pairs; // 68000 pair table hits (estimate)
+	ULONG matches;
+	ULONG treewalks; // codes longer than the 68000 lookup table
+	ULONG lengths[8]; // match length 3, 4-7, 8-15, .., 256-258
+};
+
+// deflate.c
+ULONG deflate_bound(ULONG len);
+ULONG deflate_fast(UBYTE *dst, const UBYTE *src, ULONG len, ULONG cyclesperbit, int threads);
+int deflate_predict(const UBYTE *zs, ULONG size, ULONG len, struct deflatestats *ds);